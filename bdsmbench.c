@@ -0,0 +1,318 @@
+//the benchmark of libbdsm: the tree made by bdsmgen is put in a new file system in the image and
+//read back, and every operation is timed. One CSV line is printed for every operation:
+//  mkfs      bdsmMkfs, repeated -r times
+//  mkdir     bdsmMkdir for every directory of the tree
+//  cpfile-in bdsmCopyIn for every file of the tree
+//  cpfile-out bdsmCopyOut for every file, in the directory given with -o
+//  lsdir     bdsmReadDir for every directory
+//  stat      bdsmStat for every file
+//  fsck      bdsmFsck with full, repeated -r times
+//The time of an operation includes opening and closing the image, so the sync at the end is
+//counted too. The latencies are of the single calls. The syscalls are the reads and writes of the
+//whole process from /proc/self/io, the requests given to io_uring are not in them.
+//The BDSM_* variables are used as by the command line tool, so runs with different settings can
+//be compared, and -l puts a label (e.g. the version) in the first column
+#define _DEFAULT_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "libbdsm.h"
+
+#define usage "Usage: bdsmbench [-r rounds] [-o path/to/output/directory] [-l label] path/to/host/directory path/to/image"
+
+//a directory or file of the tree, path is relative to the root of the tree and starts with /
+typedef struct {
+  char* path;
+  uint32_t size;
+} TreeEntry;
+
+typedef struct {
+  TreeEntry* entries;
+  uint32_t count;
+  uint32_t capacity;
+} TreeList;
+
+//what is measured for one operation
+typedef struct {
+  char* name;
+  uint64_t* latencies;
+  uint32_t ops;
+  uint64_t bytes;
+  uint64_t elapsed;
+  uint64_t reads;
+  uint64_t writes;
+} Measurement;
+
+char* label = "";
+//the version of the file system made by mkfs, printed in every line
+uint16_t fsVersion = 0;
+
+void check(int64_t result) {
+  if (result < 0)
+    errx(-result, "%s", bdsmError());
+}
+
+uint64_t nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//the read and write syscalls of the process so far
+void countSyscalls(uint64_t* reads, uint64_t* writes) {
+  *reads = 0;
+  *writes = 0;
+  FILE* io = fopen("/proc/self/io", "r");
+  if (io == NULL)
+    return;
+  char line[128];
+  while (fgets(line, sizeof(line), io) != NULL) {
+    unsigned long long value;
+    if (sscanf(line, "syscr: %llu", &value) == 1)
+      *reads = value;
+    if (sscanf(line, "syscw: %llu", &value) == 1)
+      *writes = value;
+  }
+  fclose(io);
+}
+
+void addEntry(TreeList* list, char path[], uint32_t size) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity * 2 + 64;
+    list->entries = realloc(list->entries, list->capacity * sizeof(TreeEntry));
+    if (list->entries == NULL)
+      err(23, "Error allocating memory for the tree");
+  }
+  list->entries[list->count].path = strdup(path);
+  list->entries[list->count++].size = size;
+}
+
+//the directories are listed parents first, the root is the empty path
+void walkTree(char root[], char relative[], TreeList* dirs, TreeList* files) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", root, relative);
+  DIR* dir = opendir(path);
+  if (dir == NULL)
+    err(15, "Error opening %s", path);
+  addEntry(dirs, relative, 0);
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char child[4096];
+    snprintf(child, sizeof(child), "%s/%s", relative, entry->d_name);
+    snprintf(path, sizeof(path), "%s%s", root, child);
+    struct stat st;
+    if (lstat(path, &st) != 0)
+      err(15, "Error opening %s", path);
+    if (S_ISDIR(st.st_mode))
+      walkTree(root, child, dirs, files);
+    else if (S_ISREG(st.st_mode))
+      addEntry(files, child, st.st_size);
+  }
+  closedir(dir);
+}
+
+void startMeasurement(Measurement* m, char name[], uint32_t ops) {
+  m->name = name;
+  m->ops = 0;
+  m->bytes = 0;
+  m->latencies = malloc((ops > 0 ? ops : 1) * sizeof(uint64_t));
+  if (m->latencies == NULL)
+    err(23, "Error allocating memory for the latencies");
+  countSyscalls(&m->reads, &m->writes);
+  m->elapsed = nanoseconds();
+}
+
+void addLatency(Measurement* m, uint64_t start, uint64_t bytes) {
+  m->latencies[m->ops++] = nanoseconds() - start;
+  m->bytes += bytes;
+}
+
+int compareLatencies(const void* a, const void* b) {
+  uint64_t first = *(uint64_t*)a;
+  uint64_t second = *(uint64_t*)b;
+  return (first > second) - (first < second);
+}
+
+//nearest rank, in microseconds
+double percentile(Measurement* m, double p) {
+  if (m->ops == 0)
+    return 0;
+  uint32_t rank = p * m->ops + 0.999999;
+  return m->latencies[(rank > 0 ? rank : 1) - 1] / 1000.0;
+}
+
+void printHeader(void) {
+  printf("label,fs_version,operation,ops,seconds,ops_per_s,mb_per_s,read_syscalls,write_syscalls,p50_us,p90_us,p99_us,max_us\n");
+}
+
+void stopMeasurement(Measurement* m) {
+  m->elapsed = nanoseconds() - m->elapsed;
+  uint64_t reads, writes;
+  countSyscalls(&reads, &writes);
+  m->reads = reads - m->reads;
+  m->writes = writes - m->writes;
+  qsort(m->latencies, m->ops, sizeof(uint64_t), compareLatencies);
+}
+
+void printMeasurement(Measurement* m) {
+  double seconds = m->elapsed / 1e9;
+  printf("%s,%u,%s,%u,%.6f,%.1f,", label, fsVersion, m->name, m->ops, seconds, m->ops / seconds);
+  if (m->bytes > 0)
+    printf("%.2f", m->bytes / 1e6 / seconds);
+  printf(",%llu,%llu,%.1f,%.1f,%.1f,%.1f\n", (unsigned long long)m->reads, (unsigned long long)m->writes,
+    percentile(m, 0.5), percentile(m, 0.9), percentile(m, 0.99), percentile(m, 1));
+  fflush(stdout);
+  free(m->latencies);
+}
+
+void finishMeasurement(Measurement* m) {
+  stopMeasurement(m);
+  printMeasurement(m);
+}
+
+//+/ and the path of the tree
+void imagePath(char buffer[], size_t size, char relative[]) {
+  snprintf(buffer, size, "+%s", relative[0] == '\0' ? "/" : relative);
+}
+
+int main(int argc, char** argv) {
+  int rounds = 5;
+  char* outputDir = NULL;
+  int option;
+  while ((option = getopt(argc, argv, "r:o:l:")) != -1) {
+    switch (option) {
+      case 'r': rounds = atoi(optarg); break;
+      case 'o': outputDir = optarg; break;
+      case 'l': label = optarg; break;
+      default: errx(1, usage);
+    }
+  }
+  if (optind != argc - 2 || rounds < 1)
+    errx(1, usage);
+  char* root = argv[optind];
+  char* image = argv[optind + 1];
+  if (outputDir != NULL && mkdir(outputDir, 0755) != 0 && errno != EEXIST)
+    err(15, "Error creating %s", outputDir);
+
+  TreeList dirs = {NULL, 0, 0};
+  TreeList files = {NULL, 0, 0};
+  walkTree(root, "", &dirs, &files);
+  char path[4096];
+  char hostPath[4096];
+  Measurement m;
+  Bdsm* fs;
+  uint64_t start;
+
+  startMeasurement(&m, "mkfs", rounds);
+  for (int i = 0; i < rounds; i++) {
+    start = nanoseconds();
+    check(bdsmMkfs(image));
+    addLatency(&m, start, 0);
+  }
+  stopMeasurement(&m);
+  check(bdsmOpen(image, O_RDONLY, &fs));
+  BdsmInfo info;
+  check(bdsmInfo(fs, &info));
+  check(bdsmClose(fs));
+  fsVersion = info.fsType;
+  printHeader();
+  printMeasurement(&m);
+
+  //the root is already there
+  startMeasurement(&m, "mkdir", dirs.count);
+  check(bdsmOpen(image, O_RDWR, &fs));
+  for (uint32_t i = 1; i < dirs.count; i++) {
+    imagePath(path, sizeof(path), dirs.entries[i].path);
+    start = nanoseconds();
+    check(bdsmMkdir(fs, path));
+    addLatency(&m, start, 0);
+  }
+  check(bdsmClose(fs));
+  finishMeasurement(&m);
+
+  startMeasurement(&m, "cpfile-in", files.count);
+  check(bdsmOpen(image, O_RDWR, &fs));
+  for (uint32_t i = 0; i < files.count; i++) {
+    imagePath(path, sizeof(path), files.entries[i].path);
+    snprintf(hostPath, sizeof(hostPath), "%s%s", root, files.entries[i].path);
+    start = nanoseconds();
+    check(bdsmCopyIn(fs, hostPath, path));
+    addLatency(&m, start, files.entries[i].size);
+  }
+  check(bdsmClose(fs));
+  finishMeasurement(&m);
+
+  //without -o the files are only read, which still checks every block
+  startMeasurement(&m, "cpfile-out", files.count);
+  check(bdsmOpen(image, O_RDONLY, &fs));
+  for (uint32_t i = 0; i < files.count; i++) {
+    imagePath(path, sizeof(path), files.entries[i].path);
+    if (outputDir != NULL)
+      snprintf(hostPath, sizeof(hostPath), "%s/f%u", outputDir, i);
+    else
+      snprintf(hostPath, sizeof(hostPath), "/dev/null");
+    start = nanoseconds();
+    check(bdsmCopyOut(fs, path, hostPath));
+    addLatency(&m, start, files.entries[i].size);
+  }
+  check(bdsmClose(fs));
+  finishMeasurement(&m);
+
+  startMeasurement(&m, "lsdir", dirs.count);
+  check(bdsmOpen(image, O_RDONLY, &fs));
+  for (uint32_t i = 0; i < dirs.count; i++) {
+    imagePath(path, sizeof(path), dirs.entries[i].path);
+    BdsmStat* entries;
+    int count;
+    start = nanoseconds();
+    check(bdsmReadDir(fs, path, &entries, &count));
+    addLatency(&m, start, 0);
+    free(entries);
+  }
+  check(bdsmClose(fs));
+  finishMeasurement(&m);
+
+  startMeasurement(&m, "stat", files.count);
+  check(bdsmOpen(image, O_RDONLY, &fs));
+  for (uint32_t i = 0; i < files.count; i++) {
+    imagePath(path, sizeof(path), files.entries[i].path);
+    BdsmStat st;
+    start = nanoseconds();
+    check(bdsmStat(fs, path, &st));
+    addLatency(&m, start, 0);
+  }
+  check(bdsmClose(fs));
+  finishMeasurement(&m);
+
+  startMeasurement(&m, "fsck", rounds);
+  for (int i = 0; i < rounds; i++) {
+    check(bdsmOpen(image, O_RDONLY, &fs));
+    BdsmFsckReport report;
+    start = nanoseconds();
+    check(bdsmFsck(fs, true, &report));
+    addLatency(&m, start, 0);
+    check(bdsmClose(fs));
+  }
+  finishMeasurement(&m);
+
+  for (uint32_t i = 0; i < dirs.count; i++) {
+    free(dirs.entries[i].path);
+  }
+  for (uint32_t i = 0; i < files.count; i++) {
+    free(files.entries[i].path);
+  }
+  free(dirs.entries);
+  free(files.entries);
+  return 0;
+}
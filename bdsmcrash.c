@@ -0,0 +1,182 @@
+//the crash test of libbdsm: a child process makes directories and files in a new file system in the
+//image and syncs after every -n of them, and is killed with SIGKILL after a random time. Then the
+//image is opened again, which replays the journal, and bdsmFsck with full must find no mistakes and
+//everything made before the last sync the child reported must be there. This is repeated -r times.
+//With a small BDSM_CACHE_BLOCKS the changes between two syncs don't fit in the cache, so the cache
+//has to grow while the transaction stays open. The BDSM_* variables are used as by the command line
+//tool. The exit status is 1 if a round failed
+#define _DEFAULT_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include "libbdsm.h"
+
+#define usage "Usage: bdsmcrash [-r rounds] [-n commands per sync] [-t max time in ms] [-s seed] path/to/image"
+
+//the child stops after so many directories if it wasn't killed
+#define maxDirectories 100000
+//the sizes of the files go round up to so many times fileUnit
+#define fileSizes 5
+#define fileUnit 3000
+
+void check(int64_t result) {
+  if (result < 0)
+    errx(-result, "%s", bdsmError());
+}
+
+//the content of the file in directory i, so that it can be checked after the crash
+void fillFile(char buffer[], uint32_t size, uint32_t i) {
+  for (uint32_t j = 0; j < size; j++)
+    buffer[j] = (char)(i * 31 + j * 7);
+}
+
+uint32_t fileSize(uint32_t i) {
+  return (i % fileSizes + 1) * fileUnit;
+}
+
+//makes +/d<i> with the file f in it until it is killed, the number of directories is written to
+//the pipe after every sync
+void runChild(char image[], int commandsPerSync, int progress) {
+  Bdsm* fs;
+  check(bdsmOpen(image, O_RDWR, &fs));
+  char buffer[fileSizes * fileUnit];
+  char path[64];
+  for (uint32_t i = 0; i < maxDirectories; i++) {
+    snprintf(path, sizeof(path), "+/d%u", i);
+    check(bdsmMkdir(fs, path));
+    snprintf(path, sizeof(path), "+/d%u/f", i);
+    BdsmFile* file;
+    check(bdsmOpenFile(fs, path, true, &file));
+    fillFile(buffer, fileSize(i), i);
+    check(bdsmWrite(file, buffer, fileSize(i)));
+    check(bdsmCloseFile(file));
+    if ((i + 1) % commandsPerSync == 0) {
+      check(bdsmSync(fs));
+      if (write(progress, &(uint32_t){i + 1}, sizeof(uint32_t)) != sizeof(uint32_t))
+        err(7, "Error writing to the pipe");
+    }
+  }
+  check(bdsmClose(fs));
+  exit(0);
+}
+
+//prints the counts of the report which aren't 0, returns whether there were any
+bool printReport(BdsmFsckReport* report) {
+  struct {
+    char* name;
+    uint64_t count;
+  } counts[] = {
+    {"Bad inodes", report->badInodes},
+    {"Dangling rows", report->danglingRows},
+    {"Double links", report->doubleLinks},
+    {"Unreachable inodes", report->unreachableInodes},
+    {"Bad extents", report->badExtents},
+    {"Wrong sizes", report->wrongSizes},
+    {"Shared datablocks", report->sharedDatablocks},
+    {"Leaked datablocks", report->leakedDatablocks},
+    {"Used free datablocks", report->usedFreeDatablocks},
+    {"Checksum errors", report->checksumErrors},
+    {"Wrong references", report->wrongReferences},
+  };
+  bool found = false;
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    if (counts[i].count > 0) {
+      printf("  %s: %llu\n", counts[i].name, (unsigned long long)counts[i].count);
+      found = true;
+    }
+  }
+  return found;
+}
+
+//the directories before synced must be there with the right files
+bool checkSynced(Bdsm* fs, uint32_t synced) {
+  char buffer[fileSizes * fileUnit];
+  char expected[fileSizes * fileUnit];
+  char path[64];
+  for (uint32_t i = 0; i < synced; i++) {
+    snprintf(path, sizeof(path), "+/d%u/f", i);
+    BdsmFile* file;
+    if (bdsmOpenFile(fs, path, false, &file) < 0) {
+      printf("  %s: %s\n", path, bdsmError());
+      return false;
+    }
+    int64_t size = bdsmRead(file, buffer, sizeof(buffer));
+    check(bdsmCloseFile(file));
+    fillFile(expected, fileSize(i), i);
+    if (size != fileSize(i) || memcmp(buffer, expected, fileSize(i)) != 0) {
+      printf("  %s has the wrong content\n", path);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  int rounds = 30;
+  int commandsPerSync = 50;
+  int maxTime = 2000;
+  unsigned int seed = 1;
+  int option;
+  while ((option = getopt(argc, argv, "r:n:t:s:")) != -1) {
+    switch (option) {
+      case 'r': rounds = atoi(optarg); break;
+      case 'n': commandsPerSync = atoi(optarg); break;
+      case 't': maxTime = atoi(optarg); break;
+      case 's': seed = atoi(optarg); break;
+      default: errx(1, usage);
+    }
+  }
+  if (optind != argc - 1 || rounds < 1 || commandsPerSync < 1 || maxTime < 1)
+    errx(1, usage);
+  char* image = argv[optind];
+  srand(seed);
+
+  int failed = 0;
+  for (int round = 1; round <= rounds; round++) {
+    check(bdsmMkfs(image));
+    //what is printed so far must not be printed again by the child
+    fflush(stdout);
+    int progress[2];
+    if (pipe(progress) != 0)
+      err(7, "Error creating a pipe");
+    pid_t child = fork();
+    if (child < 0)
+      err(7, "Error starting the child");
+    if (child == 0) {
+      close(progress[0]);
+      runChild(image, commandsPerSync, progress[1]);
+    }
+    close(progress[1]);
+    usleep((rand() % maxTime + 1) * 1000);
+    kill(child, SIGKILL);
+    int status;
+    waitpid(child, &status, 0);
+    uint32_t synced = 0;
+    uint32_t count;
+    while (read(progress[0], &count, sizeof(count)) == sizeof(count))
+      synced = count;
+    close(progress[0]);
+
+    Bdsm* fs;
+    BdsmFsckReport report;
+    printf("round %d: %u synced\n", round, synced);
+    check(bdsmOpen(image, O_RDWR, &fs));
+    //the report is filled even if the check fails
+    bool ok = bdsmFsck(fs, true, &report) == 0;
+    if (!ok)
+      printf("  %s\n", bdsmError());
+    ok = !printReport(&report) && ok;
+    ok = ok && checkSynced(fs, synced);
+    check(bdsmClose(fs));
+    failed += !ok;
+  }
+  printf("%d of %d rounds failed\n", failed, rounds);
+  return failed > 0;
+}
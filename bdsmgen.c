@@ -0,0 +1,177 @@
+//makes a synthetic tree of directories and files on the host for the benchmark, and optionally an
+//image with the same tree in it. The shape is set with options:
+//  -n files       how many files, spread over all directories (default 1000)
+//  -m bytes       the smallest file (default 64)
+//  -M bytes       the largest file (default 1048576), the sizes are log-uniform between the two,
+//                 so that there are as many files of 100-1000 bytes as of 100-1000 KB
+//  -d depth       how deep the directories go under the root (default 3)
+//  -f fanout      subdirectories of every directory which isn't at the last level (default 4)
+//  -r seed        the sizes and the data depend only on it (default 1)
+//The host directory must not exist. The image must exist with the wanted size, it gets a new file
+//system (mkfs with the BDSM_* variables) and the tree is imported in +/
+#define _DEFAULT_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "libbdsm.h"
+
+#define usage "Usage: bdsmgen [-n files] [-m min_size] [-M max_size] [-d depth] [-f fanout] [-r seed] path/to/host/directory [path/to/image]"
+//the data of a file is written with writes of up to this many bytes
+#define writeChunkBytes (1 << 20)
+
+typedef struct {
+  uint32_t files;
+  uint32_t minSize;
+  uint32_t maxSize;
+  uint32_t depth;
+  uint32_t fanout;
+  uint64_t seed;
+} Shape;
+
+//xorshift64*, the same seed gives the same tree on every machine
+uint64_t nextRandom(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+uint32_t parseNumber(char* text, char option) {
+  char* end;
+  errno = 0;
+  unsigned long value = strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || errno != 0 || value > UINT32_MAX)
+    errx(1, "-%c needs a number", option);
+  return value;
+}
+
+//the directories in the order they have to be made, parents first. The root is the empty path
+char** listDirectories(Shape* shape, uint32_t* count) {
+  uint32_t capacity = 1;
+  for (uint32_t level = 0, width = 1; level < shape->depth; level++) {
+    width *= shape->fanout;
+    capacity += width;
+  }
+  char** dirs = malloc(capacity * sizeof(char*));
+  if (dirs == NULL)
+    err(23, "Error allocating memory for the directories");
+  dirs[0] = strdup("");
+  *count = 1;
+  //every directory of a level gets its children before the next level starts
+  for (uint32_t level = 0, first = 0, last = 1; level < shape->depth; level++) {
+    for (uint32_t parent = first; parent < last; parent++) {
+      for (uint32_t child = 0; child < shape->fanout; child++) {
+        char name[4096];
+        snprintf(name, sizeof(name), "%s/d%u", dirs[parent], child);
+        dirs[(*count)++] = strdup(name);
+      }
+    }
+    first = last;
+    last = *count;
+  }
+  return dirs;
+}
+
+uint32_t fileSize(Shape* shape, uint64_t* state) {
+  double low = log((double)shape->minSize);
+  double high = log((double)shape->maxSize);
+  double position = (double)(nextRandom(state) >> 11) / (double)(1ULL << 53);
+  uint32_t size = exp(low + (high - low) * position);
+  return size < shape->minSize ? shape->minSize : size > shape->maxSize ? shape->maxSize : size;
+}
+
+//half of every file is random and half repeats it, so that it looks more like real data than noise
+void writeFile(char path[], uint32_t size, uint64_t* state, char* buffer) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    err(15, "Error creating %s", path);
+  for (uint32_t done = 0; done < size; ) {
+    uint32_t count = size - done < writeChunkBytes ? size - done : writeChunkBytes;
+    for (uint32_t i = 0; i < count; i += 8) {
+      uint64_t word = nextRandom(state);
+      if (i % 512 >= 256)
+        memcpy(&word, buffer + i - 256, 8);
+      memcpy(buffer + i, &word, 8);
+    }
+    if (write(fd, buffer, count) != (ssize_t)count)
+      err(19, "Error writing %s", path);
+    done += count;
+  }
+  close(fd);
+}
+
+void generateTree(Shape* shape, char root[]) {
+  if (mkdir(root, 0755) != 0)
+    err(15, "Error creating %s", root);
+  uint32_t dirCount;
+  char** dirs = listDirectories(shape, &dirCount);
+  char path[4096];
+  for (uint32_t i = 1; i < dirCount; i++) {
+    snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+    if (mkdir(path, 0755) != 0)
+      err(15, "Error creating %s", path);
+  }
+  char* buffer = malloc(writeChunkBytes + 8);
+  if (buffer == NULL)
+    err(23, "Error allocating memory for the data");
+  uint64_t state = shape->seed * 0x9E3779B97F4A7C15ULL + 1;
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < shape->files; i++) {
+    uint32_t size = fileSize(shape, &state);
+    //the files go round the directories, so every directory gets about the same number
+    snprintf(path, sizeof(path), "%s%s/f%u", root, dirs[i % dirCount], i);
+    writeFile(path, size, &state, buffer);
+    bytes += size;
+  }
+  printf("%u directories, %u files, %llu bytes\n", dirCount, shape->files, (unsigned long long)bytes);
+  free(buffer);
+  for (uint32_t i = 0; i < dirCount; i++) {
+    free(dirs[i]);
+  }
+  free(dirs);
+}
+
+void check(int64_t result) {
+  if (result < 0)
+    errx(-result, "%s", bdsmError());
+}
+
+int main(int argc, char** argv) {
+  Shape shape = {1000, 64, 1 << 20, 3, 4, 1};
+  int option;
+  while ((option = getopt(argc, argv, "n:m:M:d:f:r:")) != -1) {
+    switch (option) {
+      case 'n': shape.files = parseNumber(optarg, option); break;
+      case 'm': shape.minSize = parseNumber(optarg, option); break;
+      case 'M': shape.maxSize = parseNumber(optarg, option); break;
+      case 'd': shape.depth = parseNumber(optarg, option); break;
+      case 'f': shape.fanout = parseNumber(optarg, option); break;
+      case 'r': shape.seed = parseNumber(optarg, option); break;
+      default: errx(1, usage);
+    }
+  }
+  if (optind != argc - 1 && optind != argc - 2)
+    errx(1, usage);
+  if (shape.minSize == 0 || shape.minSize > shape.maxSize)
+    errx(1, "The sizes must be 0 < min_size <= max_size");
+  if ((shape.depth > 0 && shape.fanout == 0) || pow(shape.fanout, shape.depth) > 1e6)
+    errx(1, "The tree must have from 1 to a million directories");
+  generateTree(&shape, argv[optind]);
+
+  if (optind == argc - 2) {
+    check(bdsmMkfs(argv[optind + 1]));
+    Bdsm* fs;
+    check(bdsmOpen(argv[optind + 1], O_RDWR, &fs));
+    check(bdsmImport(fs, argv[optind], "+/"));
+    check(bdsmClose(fs));
+  }
+  return 0;
+}
@@ -0,0 +1,6139 @@
+//needed for preadv, pwritev and copy_file_range
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libbdsm.h"
+
+//the size of the blocks of the image is chosen by mkfs (BDSM_BLOCK_SIZE) and kept in the superblock,
+//a power of two from minBlockSize to maxBlockSize
+#define defaultBlockSize 512
+#define minBlockSize 512
+#define maxBlockSize 65536
+//with BDSM_IO=direct the buffers given to the kernel are aligned to the block size, but not more than this
+#define directAlignment 4096
+//number of blocks kept in the block cache if BDSM_CACHE_BLOCKS is not set
+#define defaultCacheBlocks 256
+//how many times the cache can double while a transaction holds more changed blocks than it has slots
+#define maxCacheGrowth 24
+//the most buffers passed to a single preadv/pwritev, IOV_MAX on Linux
+#define maxIovecs 1024
+//how many bytes of the inode table are prepared in memory before writing them with a single write
+#define inodeChunkBytes (128 << 10)
+//how many bytes cpfile moves between the host file and the image with one read/write
+#define copyChunkBytes (1 << 20)
+//a compressed file is cut in chunks of this many bytes of its data, each compressed on its own
+#define compressChunkBytes (64 << 10)
+//the hash table of the compressor has 1 << lzHashBits entries, a match is at least lzMinMatch bytes
+#define lzHashBits 12
+#define lzMinMatch 4
+//extents kept in the inode itself, the rest go in a chain of extent blocks
+#define inodeExtents 4
+//written in fsType by mkfs and changed every time the layout of the image changes
+#define fsVersion 133
+//set in Inode.reserved for directories whose rows are kept in a hash table instead of one after another
+#define inodeFlagHashed 1
+//set in Inode.reserved for objects whose data is kept in Inode.inlineData instead of in datablocks
+#define inodeFlagInline 2
+//files and directories up to this size need no datablocks, a directory row fits exactly
+#define inlineDataSize 64
+//set in Inode.reserved for files whose data is kept in compressed chunks
+#define inodeFlagCompressed 4
+//set in Inode.reserved for files written with dedup, whose datablocks may be shared with other files
+#define inodeFlagDeduped 8
+//the most buckets a hashed directory can grow to
+#define maxDirBuckets (1 << 20)
+//entries in the cache of looked up names, a power of two
+#define dentryCacheSize 4096
+//the most threads which read directories in parallel in fsck full
+#define maxFsckThreads 16
+//threads reading and writing the host files in import and export
+#define transferThreads 8
+//files up to this size are read or written by the threads in one piece, bigger ones are copied in
+//chunks by the calling thread
+#define smallFileBytes ((uint32_t)copyChunkBytes)
+//the most bytes of small files read but not written yet in import and export
+#define transferWindowBytes (64 << 20)
+//the bulk reads and writes are split in requests of at most ioRequestBytes, up to BDSM_QUEUE_DEPTH
+//(defaultQueueDepth if it is not set, at most maxQueueDepth) of them are in flight at once
+#define ioRequestBytes (64 << 10)
+#define defaultQueueDepth 16
+#define maxQueueDepth 1024
+//the most threads of the pool which does the requests when there is no io_uring
+#define maxIoThreads 16
+//the ways the I/O engine does the requests, chosen with BDSM_AIO
+#define ioSync 0
+#define ioUring 1
+#define ioThreads 2
+//the longest error message kept for bdsmError
+#define errorMessageSize 256
+//the most buffers and host files the functions of one thread can hold at once, see hold
+#define maxHeld 64
+//the journal takes 1/32 of the image, but not less than twice the checksums, the bitmaps and the dedup
+//area of the image and minJournalBytes, not more than maxJournalBytes unless that is less, and at least
+//minJournalBlocks blocks
+#define minJournalBytes (32 << 10)
+#define maxJournalBytes (8 << 20)
+#define minJournalBlocks 32
+//the first word of every transaction in the journal
+#define journalMagic 0x4a53444du
+
+//the image is laid out as superblock, inode bitmap, datablock bitmap, checksums, inodes, the dedup
+//area (only with dedup) and datablocks, the start fields are the numbers of the blocks in the image
+//where each part begins
+struct Superblock {
+  //not needed fot this implementation, but part of the superblock nevertheless
+  uint16_t fsType;
+  uint16_t inodesPerDatablock;
+  uint32_t blockSize;
+  uint32_t inodeCount;
+  uint32_t usedInodes;
+  uint32_t dataBlocks;
+  uint32_t usedDataBlocks;
+  uint32_t journalStart;
+  uint32_t journalBlocks;
+  uint32_t inodeBitmapStart;
+  uint32_t blockBitmapStart;
+  uint32_t checksumStart;
+  uint32_t inodeTableStart;
+  uint32_t firstDatablock;
+  //the high water marks - the inodes after inodesHighWater were never written and the datablocks
+  //after datablocksHighWater were never used, so mkfs doesn't have to touch them
+  uint32_t inodesHighWater;
+  uint32_t datablocksHighWater;
+  //the dedup area is a reference count for every datablock followed by an index of dedupSlots slots,
+  //dedupStart is 0 if the image was made without dedup
+  uint32_t dedupStart;
+  uint32_t dedupSlots;
+  //the datablocks with a reference count and how many references they have besides the first
+  uint32_t dedupBlocks;
+  uint32_t dedupSaved;
+  uint32_t fsSize;
+  uint16_t checkSum;
+};
+
+//a run of length neighbouring datablocks starting from start, length is 0 for an unused extent
+struct Extent {
+  int32_t start;
+  uint32_t length;
+};
+
+struct Inode {
+  char type;
+  uint32_t id;
+  uint16_t UID;
+  uint16_t GID;
+  uint16_t permissions;
+  uint16_t reserved; //flags, inodeFlagHashed, inodeFlagInline, inodeFlagCompressed or inodeFlagDeduped
+  time_t mod_time;
+  struct Extent extents[inodeExtents];
+  int32_t indirect; //the first extent block, -1 if all extents fit in the inode
+  uint32_t size;
+  char inlineData[inlineDataSize]; //the data of a small object, zeroes after size
+};
+
+//a datablock with the extents of a file which don't fit in its inode, the blocks are chained through next
+struct ExtentBlock {
+  int32_t next;
+  uint32_t count;
+  struct Extent extents[];
+};
+
+struct DirectoryRow {
+  uint32_t inodeNum;
+  char name[60];
+};
+
+//a name looked up in a directory - child is the inode with this name or -1 if there is no such
+//name (a negative entry), parent is -1 while the entry is unused
+struct DentryCacheEntry {
+  int64_t parent;
+  int32_t child;
+  char name[sizeof(((struct DirectoryRow*)NULL)->name)];
+};
+
+//where the undo log has the copy of a block from before the call which changes the image, the
+//block is saved in the running call only if call is the number of that call
+struct UndoMark {
+  uint64_t call;
+  uint32_t entry;
+};
+
+//one bit for every inode or datablock, set if it is used. The whole bitmap is kept in memory
+//as 64-bit words, so that 64 inodes or datablocks are checked at once, and only the blocks
+//of the bitmap which were changed are written back
+struct Bitmap {
+  uint64_t* words;
+  uint32_t bits;
+  //where the bitmap starts in the image and how many blocks it takes
+  uint32_t start;
+  uint32_t blocks;
+  uint32_t blockSize;
+  bool* dirty;
+  uint32_t dirtyCount;
+  //there is no free bit before it, so the search for a free one starts from here
+  uint32_t hint;
+  //the blocks of the bitmap saved in the undo log
+  struct UndoMark* marks;
+};
+
+//one block of the image kept in memory, block is -1 while the slot is unused
+struct CacheSlot {
+  int64_t block;
+  bool dirty;
+  uint64_t lastUsed;
+  struct CacheSlot* nextInBucket;
+  char* data;
+  struct UndoMark mark;
+};
+
+struct BlockCache {
+  struct CacheSlot* slots;
+  int slotCount;
+  struct CacheSlot** buckets;
+  int bucketCount;
+  //incremented on every access, the slot with the smallest lastUsed is the least recently used one
+  uint64_t clock;
+  int dirtyCount;
+  //the memory of the slots, a new part is added every time the cache grows
+  char* data[maxCacheGrowth];
+  int dataCount;
+};
+
+typedef struct Inode Inode;
+
+typedef struct Extent Extent;
+
+typedef struct ExtentBlock ExtentBlock;
+
+typedef struct Superblock Superblock;
+
+typedef struct DirectoryRow DirectoryRow;
+
+typedef struct CacheSlot CacheSlot;
+
+typedef struct BlockCache BlockCache;
+
+typedef struct Bitmap Bitmap;
+
+typedef struct DentryCacheEntry DentryCacheEntry;
+
+typedef struct UndoMark UndoMark;
+
+//the CRC32C of every block from the start of the inode table to the end of the image, kept in the
+//checksum area. Its blocks are read when they are first needed and the changed ones are written by syncFS
+struct ChecksumArea {
+  uint32_t start;
+  uint32_t blocks;
+  uint32_t firstCovered;
+  uint32_t** entries;
+  bool* dirty;
+  uint32_t dirtyCount;
+};
+
+typedef struct ChecksumArea ChecksumArea;
+
+//the changed metadata (the superblock, the bitmaps, the inodes, the directories, the extent blocks
+//and the checksums) is written first in the journal and only then in its place. The journal is split
+//in two halves and transaction n goes in half n % 2, so the previous transaction is kept until the
+//next one is committed
+struct Journal {
+  uint32_t start;
+  uint32_t halfBlocks;
+  //the most blocks in one transaction, so that they and their numbers fit in a half
+  uint32_t capacity;
+  uint32_t sequence;
+  //the header of the transaction followed by the numbers of its blocks, then their new contents
+  uint32_t* descriptor;
+  char* data;
+  uint32_t count;
+  //set while syncFS collects the transaction
+  bool inSync;
+  //the blocks of the transactions in the two halves, which a replay would write again, and a bit
+  //for every block of the image which is in one of them
+  uint32_t* halfContents[2];
+  uint32_t halfCounts[2];
+  uint64_t* replayable;
+  //replayable blocks written since the last sync, whose new contents go in the next transaction
+  uint32_t* revoked;
+  uint32_t revokedCount;
+  uint32_t revokedCapacity;
+};
+
+typedef struct Journal Journal;
+
+//a block saved in the undo log, of one of the bitmaps or of the image. Its copy is block number data
+//of the log. A block in the cache which had no changes before the call has no copy, it is only
+//dropped from the cache, since the image has it as it was
+struct UndoEntry {
+  struct Bitmap* bitmap;
+  int64_t block;
+  bool copied;
+  bool wasDirty;
+  uint32_t data;
+};
+
+typedef struct UndoEntry UndoEntry;
+
+//what a call which changes the image needs to undo its changes when it fails, so that the next sync
+//doesn't commit half of them - the superblock and every block of the bitmaps and of the cache or the
+//mapping from before the first change of the call in it. It is emptied when the call succeeds and by
+//every sync
+struct UndoLog {
+  bool active;
+  uint64_t call;
+  Superblock sb;
+  bool sbDirty;
+  UndoEntry* entries;
+  uint32_t count;
+  uint32_t capacity;
+  char* data;
+  uint32_t dataCount;
+  uint32_t dataCapacity;
+  //with mmap - one bit for each block of the image which is saved
+  uint64_t* mapSaved;
+  //the runs of datablocks freed by the call. Their bits are cleared when it ends, so that they
+  //aren't taken and written again while their old contents may be needed
+  Extent* freed;
+  uint32_t freedCount;
+  uint32_t freedCapacity;
+};
+
+typedef struct UndoLog UndoLog;
+
+//one read or write of the image done by the I/O engine
+struct IoRequest {
+  bool write;
+  char* buffer;
+  size_t length;
+  off_t offset;
+  //how much is done, a short read or write is given to the engine again for the rest
+  size_t done;
+  //the errno of a failed request, 0 if it succeeded
+  int error;
+  struct iovec iov;
+};
+
+typedef struct IoRequest IoRequest;
+
+//the engine of the bulk reads and writes: a batch of requests is given to io_uring, or to a pool of
+//threads doing pread and pwrite if the kernel has no io_uring, up to depth of them are in flight and
+//they finish in any order. It is started the first time a batch has more than one request. The
+//queue of the handle is used by the thread which opened it, the fsck threads have their own
+struct IoQueue {
+  int kind;
+  uint32_t depth;
+  int fd;
+  //io_uring - the ring and its three mapped areas, and the requests which have to be submitted again
+  int ring;
+  struct io_uring_params params;
+  char* sq;
+  size_t sqSize;
+  char* cq;
+  size_t cqSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+  uint32_t* retry;
+  //the pool works on one batch at a time, next is the first request no thread has taken
+  pthread_t threads[maxIoThreads];
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  IoRequest* batch;
+  uint32_t batchCount;
+  uint32_t next;
+  uint32_t finished;
+  bool stop;
+};
+
+typedef struct IoQueue IoQueue;
+
+//blocks of the image from first, one after another
+typedef struct {
+  int64_t first;
+  uint32_t count;
+} BlockRun;
+
+//everything a command needs to work with the image - the file descriptor, the superblock
+//which is kept in memory and written once when the command ends and the block cache.
+//With BDSM_IO=mmap the whole image is mapped instead and the cache is not used, the commands
+//which change the image get a private mapping whose changed blocks go through the journal.
+//The bitmaps are read only by the commands which allocate or check something.
+//The looked up names are remembered in dentries until the image is closed
+struct FileSystem {
+  int fd;
+  //the size of the blocks, read from the superblock when the image is opened, and whether the
+  //image is opened with O_DIRECT (BDSM_IO=direct)
+  uint32_t blockSize;
+  bool direct;
+  //the image was opened with O_RDONLY, so the commands which change it fail
+  bool readOnly;
+  Superblock sb;
+  bool sbDirty;
+  BlockCache cache;
+  char* map;
+  size_t mapSize;
+  bool bitmapsLoaded;
+  Bitmap inodeBitmap;
+  Bitmap blockBitmap;
+  DentryCacheEntry* dentries;
+  uint64_t dentryHits;
+  uint64_t dentryMisses;
+  //the blocks written with dedup which were found in the image and the ones which were not
+  uint64_t dedupHits;
+  uint64_t dedupMisses;
+  ChecksumArea sums;
+  //with mmap - one bit for each block of the image which was changed since the last syncFS
+  //and one for each block whose checksum was already checked
+  uint64_t* mapDirty;
+  uint64_t mapDirtyCount;
+  uint64_t* mapVerified;
+  Journal journal;
+  UndoLog undo;
+  IoQueue io;
+  char* path;
+  uint32_t replayedBlocks;
+};
+
+typedef struct FileSystem FileSystem;
+
+//every public function sets an error boundary with setjmp and the functions inside it report
+//errors with fail or failErrno, which jump back to it, so the caller gets the error code instead
+//of the process exiting. The boundary and the message belong to the thread
+typedef struct ErrorBoundary {
+  jmp_buf jump;
+  int code;
+  struct ErrorBoundary* outer;
+  //how many resources were held when the boundary was set
+  int heldMark;
+} ErrorBoundary;
+
+static __thread ErrorBoundary* currentBoundary = NULL;
+static __thread char lastError[errorMessageSize];
+
+//the buffers, host files and the like a function has while it may fail. The address of the pointer or
+//the descriptor is kept, so a realloc after holdMemory is seen too. After an error everything held since
+//the boundary was set is released before the jump, otherwise the function lets go of it
+typedef struct {
+  void* resource;
+  void (*release)(void* resource);
+} HeldResource;
+
+static __thread HeldResource held[maxHeld];
+static __thread int heldCount = 0;
+
+static void fail(int code, char format[], ...) __attribute__((noreturn, format(printf, 2, 3)));
+static void failErrno(int code, char format[], ...) __attribute__((noreturn, format(printf, 2, 3)));
+
+static void jumpToBoundary(int code) __attribute__((noreturn));
+
+//releases the resources held after the first mark of them, the last one first
+static void releaseHeld(int mark) {
+  while (heldCount > mark) {
+    heldCount--;
+    held[heldCount].release(held[heldCount].resource);
+  }
+}
+
+static void jumpToBoundary(int code) {
+  //only the public functions may call the rest, so there is always a boundary
+  if (currentBoundary == NULL)
+    abort();
+  releaseHeld(currentBoundary->heldMark);
+  currentBoundary->code = code;
+  longjmp(currentBoundary->jump, 1);
+}
+
+static void fail(int code, char format[], ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(lastError, sizeof(lastError), format, args);
+  va_end(args);
+  jumpToBoundary(code);
+}
+
+//as fail, but with the description of errno at the end, as err prints it
+static void failErrno(int code, char format[], ...) {
+  int saved = errno;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(lastError, sizeof(lastError), format, args);
+  va_end(args);
+  size_t length = strlen(lastError);
+  snprintf(lastError + length, sizeof(lastError) - length, ": %s", strerror(saved));
+  jumpToBoundary(code);
+}
+
+//release is called with resource if the function fails before it lets go of it
+static void hold(void* resource, void (*release)(void* resource)) {
+  if (heldCount == maxHeld) {
+    release(resource);
+    fail(23, "Too many buffers at once");
+  }
+  held[heldCount].resource = resource;
+  held[heldCount++].release = release;
+}
+
+static void releaseMemory(void* pointer) {
+  free(*(void**)pointer);
+  *(void**)pointer = NULL;
+}
+
+static void releaseFd(void* fd) {
+  if (*(int*)fd >= 0)
+    close(*(int*)fd);
+  *(int*)fd = -1;
+}
+
+//pointer is the address of a pointer to memory from malloc, which may be NULL
+static void holdMemory(void* pointer) {
+  hold(pointer, releaseMemory);
+}
+
+static void holdFd(int* fd) {
+  hold(fd, releaseFd);
+}
+
+//the resource given to hold is the function's own again
+static void letGo(void* resource) {
+  for (int i = heldCount - 1; i >= 0; i--) {
+    if (held[i].resource == resource) {
+      memmove(&held[i], &held[i + 1], (heldCount - i - 1) * sizeof(HeldResource));
+      heldCount--;
+      return;
+    }
+  }
+}
+
+static void freeHeld(void* pointer) {
+  letGo(pointer);
+  releaseMemory(pointer);
+}
+
+//the start of every public function - after an error inside it the function returns minus the code
+#define enterLibrary() \
+  ErrorBoundary boundary; \
+  boundary.outer = currentBoundary; \
+  boundary.heldMark = heldCount; \
+  if (setjmp(boundary.jump) != 0) { \
+    currentBoundary = boundary.outer; \
+    return -boundary.code; \
+  } \
+  currentBoundary = &boundary
+
+#define leaveLibrary(result) \
+  do { \
+    heldCount = boundary.heldMark; \
+    currentBoundary = boundary.outer; \
+    return (result); \
+  } while (0)
+
+//the start of a public function which changes the file system - after an error the changes it
+//made in memory are undone, so the next sync doesn't write half of them
+#define enterChange(fs) \
+  ErrorBoundary boundary; \
+  boundary.outer = currentBoundary; \
+  boundary.heldMark = heldCount; \
+  if (setjmp(boundary.jump) != 0) { \
+    currentBoundary = boundary.outer; \
+    rollBack(fs); \
+    return -boundary.code; \
+  } \
+  currentBoundary = &boundary; \
+  if ((fs)->readOnly) \
+    fail(37, "The file system is opened only for reading"); \
+  makeJournalRoom(fs); \
+  beginChange(fs)
+
+#define leaveChange(fs, result) \
+  do { \
+    checkJournalSpace(fs); \
+    endChange(fs); \
+    leaveLibrary(result); \
+  } while (0)
+
+char* bdsmError(void) {
+  return lastError;
+}
+
+//the size of the image - st_size is 0 for a block device, so its size is asked from the kernel
+static uint64_t getSize(FileSystem* fs) {
+  struct stat st;
+  if (fstat(fs->fd, &st) != 0)
+    failErrno(2, "BDSM file cannot be opened");
+  if (!S_ISBLK(st.st_mode))
+    return st.st_size;
+  uint64_t size;
+  if (ioctl(fs->fd, BLKGETSIZE64, &size) != 0)
+    failErrno(2, "Error getting the size of the BDSM device");
+  return size;
+} 
+
+//the safe functions leave the descriptor open after an error - the image is closed by releaseFS and
+//a host file by the function which opened it
+static void safeWrite(int fd, void* data, size_t size, int errNum, char errMsg[]) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t count = write(fd, (char*)data + written, size - written);
+    if (count < 0) {
+      failErrno(errNum, errMsg);
+    }
+    written += count;
+  }
+}
+
+//reads until size bytes are read or the end of the file is reached and returns how many were read
+static size_t safeRead(int fd, void* data, size_t size, int errNum, char errMsg[]) {
+  size_t readBytes = 0;
+  while (readBytes < size) {
+    ssize_t count = read(fd, (char*)data + readBytes, size - readBytes);
+    if (count < 0) {
+      failErrno(errNum, errMsg);
+    }
+    if (count == 0)
+      break;
+    readBytes += count;
+  }
+  return readBytes;
+}
+
+//reads into the buffers from the given offset without moving the file position, so there is
+//no lseek before it and it can be called from several threads. Whatever is after the end of the
+//file is filled with zeroes. The iovecs are changed while the short reads are continued
+static void safePreadv(int fd, struct iovec* iov, int count, off_t offset, int errNum, char errMsg[]) {
+  while (count > 0) {
+    ssize_t done = preadv(fd, iov, count < maxIovecs ? count : maxIovecs, offset);
+    if (done < 0) {
+      failErrno(errNum, errMsg);
+    }
+    if (done == 0) {
+      for (int i = 0; i < count; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+      }
+      return;
+    }
+    offset += done;
+    while (count > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+}
+
+static void safePwritev(int fd, struct iovec* iov, int count, off_t offset, int errNum, char errMsg[]) {
+  while (count > 0) {
+    ssize_t done = pwritev(fd, iov, count < maxIovecs ? count : maxIovecs, offset);
+    if (done < 0) {
+      failErrno(errNum, errMsg);
+    }
+    offset += done;
+    while (count > 0 && (size_t)done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+}
+
+static void safePread(int fd, void* data, size_t size, off_t offset, int errNum, char errMsg[]) {
+  struct iovec iov = {data, size};
+  safePreadv(fd, &iov, 1, offset, errNum, errMsg);
+}
+
+static void safePwrite(int fd, void* data, size_t size, off_t offset, int errNum, char errMsg[]) {
+  struct iovec iov = {data, size};
+  safePwritev(fd, &iov, 1, offset, errNum, errMsg);
+}
+
+//every block of a transfer with the image is at an offset which is a multiple of the block size and
+//with O_DIRECT the buffers have to be aligned as well
+static size_t ioAlignment(FileSystem* fs) {
+  return fs->blockSize < directAlignment ? fs->blockSize : directAlignment;
+}
+
+//a buffer for count blocks which can be passed to O_DIRECT reads and writes, freed with free
+static void* allocBlocks(FileSystem* fs, size_t count) {
+  void* buffer;
+  if (posix_memalign(&buffer, directAlignment, count * fs->blockSize) != 0)
+    return NULL;
+  return buffer;
+}
+
+//checksums in one block of the checksum area
+static uint32_t checksumsPerBlock(FileSystem* fs) {
+  return fs->blockSize / sizeof(uint32_t);
+}
+
+//reference counts or index slots in one block of the dedup area
+static uint32_t dedupWordsPerBlock(FileSystem* fs) {
+  return fs->blockSize / sizeof(uint32_t);
+}
+
+//the extents which fit in an extent block after next and count
+static int extentsPerBlock(FileSystem* fs) {
+  return (fs->blockSize - 2 * sizeof(int32_t)) / sizeof(Extent);
+}
+
+static uint32_t copyChunkBlocks(FileSystem* fs) {
+  return copyChunkBytes / fs->blockSize;
+}
+
+static uint32_t inodeChunkBlocks(FileSystem* fs) {
+  return inodeChunkBytes / fs->blockSize;
+}
+
+static uint32_t compressChunkBlocks(FileSystem* fs) {
+  return compressChunkBytes / fs->blockSize;
+}
+
+static bool isAligned(FileSystem* fs, void* buffer) {
+  return !fs->direct || (uintptr_t)buffer % ioAlignment(fs) == 0;
+}
+
+//the reads and writes of the image. The buffers of the cache, the journal and the copies are
+//allocated aligned, any other buffer goes through an aligned copy with O_DIRECT
+static void imagePread(FileSystem* fs, void* data, size_t size, off_t offset, int errNum, char errMsg[]) {
+  if (isAligned(fs, data)) {
+    safePread(fs->fd, data, size, offset, errNum, errMsg);
+    return;
+  }
+  void* bounce = allocBlocks(fs, size / fs->blockSize + 1);
+  if (bounce == NULL)
+    failErrno(23, "Error allocating memory for reading the file system");
+  holdMemory(&bounce);
+  safePread(fs->fd, bounce, size, offset, errNum, errMsg);
+  memcpy(data, bounce, size);
+  freeHeld(&bounce);
+}
+
+static void imagePwrite(FileSystem* fs, void* data, size_t size, off_t offset, int errNum, char errMsg[]) {
+  if (isAligned(fs, data)) {
+    safePwrite(fs->fd, data, size, offset, errNum, errMsg);
+    return;
+  }
+  void* bounce = allocBlocks(fs, size / fs->blockSize + 1);
+  if (bounce == NULL)
+    failErrno(23, "Error allocating memory for writing the file system");
+  holdMemory(&bounce);
+  memcpy(bounce, data, size);
+  safePwrite(fs->fd, bounce, size, offset, errNum, errMsg);
+  freeHeld(&bounce);
+}
+
+static void imagePwritev(FileSystem* fs, struct iovec* iov, int count, off_t offset, int errNum, char errMsg[]) {
+  bool aligned = true;
+  for (int i = 0; i < count; i++) {
+    aligned = aligned && isAligned(fs, iov[i].iov_base);
+  }
+  if (aligned) {
+    safePwritev(fs->fd, iov, count, offset, errNum, errMsg);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    imagePwrite(fs, iov[i].iov_base, iov[i].iov_len, offset, errNum, errMsg);
+    offset += iov[i].iov_len;
+  }
+}
+
+//BDSM_AIO=uring (the default) uses io_uring and the pool of threads if the kernel doesn't have it,
+//threads always uses the pool and sync does the requests one after another, e.g. to compare them
+static int requestedIoKind(void) {
+  char* mode = getenv("BDSM_AIO");
+  if (mode == NULL || strcmp(mode, "uring") == 0)
+    return ioUring;
+  if (strcmp(mode, "threads") == 0)
+    return ioThreads;
+  if (strcmp(mode, "sync") != 0)
+    fail(1, "BDSM_AIO must be uring, threads or sync");
+  return ioSync;
+}
+
+static uint32_t queueDepth(void) {
+  char* depth = getenv("BDSM_QUEUE_DEPTH");
+  if (depth == NULL)
+    return defaultQueueDepth;
+  char* end;
+  unsigned long value = strtoul(depth, &end, 10);
+  if (*depth == '\0' || *end != '\0' || value < 1 || value > maxQueueDepth)
+    fail(1, "BDSM_QUEUE_DEPTH must be from 1 to %d", maxQueueDepth);
+  return value;
+}
+
+//how many blocks the bulk readers ask for at once - enough for a full queue, but at least copyChunkBytes
+static uint32_t batchBlocks(FileSystem* fs) {
+  uint64_t bytes = (uint64_t)queueDepth() * ioRequestBytes;
+  return (bytes > copyChunkBytes ? bytes : copyChunkBytes) / fs->blockSize;
+}
+
+//the whole request with pread or pwrite, a read after the end of the file gives zeroes as safePreadv
+static void performRequest(int fd, IoRequest* r) {
+  while (r->done < r->length) {
+    ssize_t count = r->write
+      ? pwrite(fd, r->buffer + r->done, r->length - r->done, r->offset + r->done)
+      : pread(fd, r->buffer + r->done, r->length - r->done, r->offset + r->done);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0) {
+      r->error = errno;
+      return;
+    }
+    if (count == 0 && r->write) {
+      r->error = EIO;
+      return;
+    }
+    if (count == 0) {
+      memset(r->buffer + r->done, 0, r->length - r->done);
+      r->done = r->length;
+    }
+    r->done += count;
+  }
+}
+
+static bool startUring(IoQueue* q) {
+  memset(&q->params, 0, sizeof(q->params));
+  q->ring = syscall(__NR_io_uring_setup, q->depth, &q->params);
+  if (q->ring < 0)
+    return false;
+  struct io_uring_params* p = &q->params;
+  q->sqSize = p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+  q->cqSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  q->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+  q->sq = mmap(NULL, q->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQ_RING);
+  q->cq = mmap(NULL, q->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_CQ_RING);
+  q->sqes = mmap(NULL, q->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQES);
+  q->retry = malloc(q->depth * sizeof(uint32_t));
+  if (q->sq == MAP_FAILED || q->cq == MAP_FAILED || q->sqes == MAP_FAILED || q->retry == NULL) {
+    if (q->sq != MAP_FAILED)
+      munmap(q->sq, q->sqSize);
+    if (q->cq != MAP_FAILED)
+      munmap(q->cq, q->cqSize);
+    if (q->sqes != MAP_FAILED)
+      munmap(q->sqes, q->sqesSize);
+    free(q->retry);
+    q->retry = NULL;
+    close(q->ring);
+    return false;
+  }
+  return true;
+}
+
+static void* ioWorker(void* arg) {
+  IoQueue* q = arg;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (!q->stop && (q->batch == NULL || q->next == q->batchCount)) {
+      pthread_cond_wait(&q->changed, &q->lock);
+    }
+    if (q->stop)
+      break;
+    IoRequest* r = &q->batch[q->next++];
+    pthread_mutex_unlock(&q->lock);
+    performRequest(q->fd, r);
+    pthread_mutex_lock(&q->lock);
+    if (++q->finished == q->batchCount)
+      pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+static void startThreads(IoQueue* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+  q->batch = NULL;
+  q->stop = false;
+  q->started = 0;
+  int count = q->depth < maxIoThreads ? q->depth : maxIoThreads;
+  while (q->started < count && pthread_create(&q->threads[q->started], NULL, ioWorker, q) == 0) {
+    q->started++;
+  }
+}
+
+static void stopIoQueue(IoQueue* q) {
+  if (q->kind == ioUring) {
+    munmap(q->sq, q->sqSize);
+    munmap(q->cq, q->cqSize);
+    munmap(q->sqes, q->sqesSize);
+    free(q->retry);
+    close(q->ring);
+  } else if (q->kind == ioThreads) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->started; i++) {
+      pthread_join(q->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+  }
+  q->kind = ioSync;
+  q->depth = 0;
+}
+
+//q has to be filled with zeroes before the first call. io_uring falls back to the pool and the pool
+//to the requests one after another if they can't be started
+static void startIoQueue(IoQueue* q, int fd) {
+  if (q->depth != 0)
+    return;
+  q->fd = fd;
+  q->kind = requestedIoKind();
+  q->depth = queueDepth();
+  if (q->kind == ioUring && !startUring(q))
+    q->kind = ioThreads;
+  if (q->kind == ioThreads) {
+    startThreads(q);
+    if (q->started == 0) {
+      pthread_mutex_destroy(&q->lock);
+      pthread_cond_destroy(&q->changed);
+      q->kind = ioSync;
+    }
+  }
+}
+
+static void runUring(IoQueue* q, IoRequest* requests, uint32_t count) {
+  struct io_uring_params* p = &q->params;
+  uint32_t* sqTail = (uint32_t*)(q->sq + p->sq_off.tail);
+  uint32_t sqMask = *(uint32_t*)(q->sq + p->sq_off.ring_mask);
+  uint32_t* sqArray = (uint32_t*)(q->sq + p->sq_off.array);
+  uint32_t* cqHead = (uint32_t*)(q->cq + p->cq_off.head);
+  uint32_t* cqTail = (uint32_t*)(q->cq + p->cq_off.tail);
+  uint32_t cqMask = *(uint32_t*)(q->cq + p->cq_off.ring_mask);
+  struct io_uring_cqe* cqes = (struct io_uring_cqe*)(q->cq + p->cq_off.cqes);
+  uint32_t next = 0;
+  uint32_t retries = 0;
+  uint32_t inFlight = 0;
+  uint32_t finished = 0;
+  //the entries put in the submission ring which the kernel hasn't taken yet
+  uint32_t unsubmitted = 0;
+  while (finished < count) {
+    uint32_t tail = *sqTail;
+    while (inFlight < q->depth && (retries > 0 || next < count)) {
+      uint32_t index = retries > 0 ? q->retry[--retries] : next++;
+      IoRequest* r = &requests[index];
+      r->iov.iov_base = r->buffer + r->done;
+      r->iov.iov_len = r->length - r->done;
+      struct io_uring_sqe* sqe = &q->sqes[tail & sqMask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = q->fd;
+      sqe->off = r->offset + r->done;
+      sqe->addr = (uintptr_t)&r->iov;
+      sqe->len = 1;
+      sqe->user_data = index;
+      sqArray[tail & sqMask] = tail & sqMask;
+      tail++;
+      inFlight++;
+      unsubmitted++;
+    }
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    int submitted = syscall(__NR_io_uring_enter, q->ring, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0 && errno != EINTR)
+      failErrno(6, "Error waiting for the reads and writes of the file system");
+    if (submitted > 0)
+      unsubmitted -= submitted;
+    uint32_t head = *cqHead;
+    for (; head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head++) {
+      struct io_uring_cqe* cqe = &cqes[head & cqMask];
+      IoRequest* r = &requests[cqe->user_data];
+      inFlight--;
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        q->retry[retries++] = cqe->user_data;
+        continue;
+      }
+      if (cqe->res < 0) {
+        r->error = -cqe->res;
+      } else if (cqe->res == 0 && r->write) {
+        r->error = EIO;
+      } else if (cqe->res == 0) {
+        memset(r->buffer + r->done, 0, r->length - r->done);
+        r->done = r->length;
+      } else {
+        r->done += cqe->res;
+      }
+      if (r->error == 0 && r->done < r->length)
+        q->retry[retries++] = cqe->user_data;
+      else
+        finished++;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+}
+
+static void runThreads(IoQueue* q, IoRequest* requests, uint32_t count) {
+  pthread_mutex_lock(&q->lock);
+  q->batch = requests;
+  q->batchCount = count;
+  q->next = 0;
+  q->finished = 0;
+  pthread_cond_broadcast(&q->changed);
+  while (q->finished < count) {
+    pthread_cond_wait(&q->changed, &q->lock);
+  }
+  q->batch = NULL;
+  pthread_mutex_unlock(&q->lock);
+}
+
+//reads or writes the runs of the image one after another in buffer. A run which fits in one request
+//is a single pread or pwrite as before, the rest are split in requests and given to the queue
+static void transferRuns(FileSystem* fs, IoQueue* q, bool write, BlockRun* runs, int count, char* buffer) {
+  uint32_t requestCount = 0;
+  for (int i = 0; i < count; i++) {
+    size_t length = (size_t)runs[i].count * fs->blockSize;
+    requestCount += length / ioRequestBytes + (length % ioRequestBytes == 0 ? 0 : 1);
+  }
+  if (requestCount <= 1 || !isAligned(fs, buffer) || requestedIoKind() == ioSync) {
+    for (int i = 0; i < count; i++) {
+      size_t length = (size_t)runs[i].count * fs->blockSize;
+      if (write)
+        imagePwrite(fs, buffer, length, runs[i].first * fs->blockSize, 7, "Error writing blocks of the file system");
+      else
+        imagePread(fs, buffer, length, runs[i].first * fs->blockSize, 6, "Error reading blocks of the file system");
+      buffer += length;
+    }
+    return;
+  }
+  IoRequest* requests = malloc(requestCount * sizeof(IoRequest));
+  if (requests == NULL)
+    failErrno(23, "Error allocating memory for the reads and writes of the file system");
+  holdMemory(&requests);
+  uint32_t made = 0;
+  for (int i = 0; i < count; i++) {
+    off_t offset = runs[i].first * fs->blockSize;
+    off_t end = offset + (off_t)runs[i].count * fs->blockSize;
+    for (; offset < end; offset += ioRequestBytes) {
+      IoRequest* r = &requests[made++];
+      memset(r, 0, sizeof(*r));
+      r->write = write;
+      r->buffer = buffer;
+      r->length = end - offset < ioRequestBytes ? (size_t)(end - offset) : ioRequestBytes;
+      r->offset = offset;
+      buffer += r->length;
+    }
+  }
+  startIoQueue(q, fs->fd);
+  if (q->kind == ioUring) {
+    runUring(q, requests, requestCount);
+  } else if (q->kind == ioThreads) {
+    runThreads(q, requests, requestCount);
+  } else {
+    for (uint32_t i = 0; i < requestCount; i++) {
+      performRequest(fs->fd, &requests[i]);
+    }
+  }
+  for (uint32_t i = 0; i < requestCount; i++) {
+    if (requests[i].error != 0) {
+      errno = requests[i].error;
+      if (write)
+        failErrno(7, "Error writing blocks of the file system");
+      failErrno(6, "Error reading blocks of the file system");
+    }
+  }
+  freeHeld(&requests);
+}
+
+//the bytes after which the sums of Fletcher16 have to be reduced, so that sum2 still fits in 32 bits
+#define fletcherBlock 5802
+
+//the modulo is taken once every fletcherBlock bytes instead of twice for every byte, the result is the same
+static uint16_t Fletcher16(uint8_t *data, int count) {
+  uint32_t sum1 = 0;
+  uint32_t sum2 = 0;
+  
+  while (count > 0) {
+    int block = count < fletcherBlock ? count : fletcherBlock;
+    count -= block;
+    for (int index = 0; index < block; index++) {
+      sum1 += data[index];
+      sum2 += sum1;
+    }
+    data += block;
+    sum1 %= 255;
+    sum2 %= 255;
+  }
+
+  return (sum2 << 8) | sum1;
+}
+
+static uint32_t crc32cTable[256];
+
+//CRC32C (Castagnoli) a byte at a time, used when the processor has no crc32 instruction
+static uint32_t crc32cSoftware(uint8_t* data, size_t size) {
+  if (crc32cTable[1] == 0) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+      }
+      crc32cTable[i] = crc;
+    }
+  }
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; i++) {
+    crc = (crc >> 8) ^ crc32cTable[(crc ^ data[i]) & 0xFF];
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//the crc32 instruction from SSE4.2 takes 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint8_t* data, size_t size) {
+  uint64_t crc = 0xFFFFFFFFu;
+  for (; size >= 8; size -= 8, data += 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __builtin_ia32_crc32di(crc, word);
+  }
+  for (; size > 0; size--, data++) {
+    crc = __builtin_ia32_crc32qi((uint32_t)crc, *data);
+  }
+  return ~(uint32_t)crc;
+}
+#endif
+
+static uint32_t crc32c(uint8_t* data, size_t size) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  static int hardware = -1;
+  if (hardware == -1)
+    hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware)
+    return crc32cHardware(data, size);
+#endif
+  return crc32cSoftware(data, size);
+}
+
+static uint32_t readWord(uint8_t* data) {
+  uint32_t word;
+  memcpy(&word, data, sizeof(word));
+  return word;
+}
+
+//a length which doesn't fit in its 4 bits of the token continues in bytes of 255 and the rest
+static uint32_t putLength(uint8_t* out, uint32_t o, uint32_t length) {
+  for (; length >= 255; length -= 255) {
+    out[o++] = 255;
+  }
+  out[o++] = length;
+  return o;
+}
+
+static bool getLength(uint8_t* in, uint32_t inSize, uint32_t* i, uint32_t* length) {
+  uint8_t byte;
+  do {
+    if (*i == inSize)
+      return false;
+    byte = in[(*i)++];
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+//LZ77 in the block format of LZ4: every sequence is a token with 4 bits for the number of literals
+//and 4 for the length of the match minus lzMinMatch, the literals, and the offset of the match in
+//2 bytes. The last sequence has only literals. The matches are found through a hash table of the
+//last position of every 4 bytes, and the search speeds up in data which doesn't repeat.
+//out has room for size bytes, size is returned if the data doesn't get shorter
+static uint32_t lzCompress(uint8_t* in, uint32_t size, uint8_t* out) {
+  uint32_t table[1 << lzHashBits];
+  memset(table, 0, sizeof(table));
+  uint32_t pos = 0;
+  uint32_t anchor = 0;
+  uint32_t o = 0;
+  while (pos + lzMinMatch <= size) {
+    uint32_t word = readWord(in + pos);
+    uint32_t hash = (word * 2654435761u) >> (32 - lzHashBits);
+    //the positions are kept plus one, 0 is an empty entry
+    uint32_t candidate = table[hash];
+    table[hash] = pos + 1;
+    if (candidate == 0 || pos - (candidate - 1) > 65535 || readWord(in + candidate - 1) != word) {
+      pos += 1 + ((pos - anchor) >> 6);
+      continue;
+    }
+    candidate--;
+    uint32_t length = lzMinMatch;
+    while (pos + length < size && in[candidate + length] == in[pos + length]) {
+      length++;
+    }
+    uint32_t literals = pos - anchor;
+    if ((uint64_t)o + 1 + literals + literals / 255 + 1 + 2 + length / 255 + 1 >= size)
+      return size;
+    uint32_t extra = length - lzMinMatch;
+    out[o++] = (literals < 15 ? literals : 15) << 4 | (extra < 15 ? extra : 15);
+    if (literals >= 15)
+      o = putLength(out, o, literals - 15);
+    memcpy(out + o, in + anchor, literals);
+    o += literals;
+    out[o++] = (pos - candidate) & 0xff;
+    out[o++] = (pos - candidate) >> 8;
+    if (extra >= 15)
+      o = putLength(out, o, extra - 15);
+    pos += length;
+    anchor = pos;
+  }
+  uint32_t literals = size - anchor;
+  if ((uint64_t)o + 1 + literals + literals / 255 + 1 >= size)
+    return size;
+  out[o++] = (literals < 15 ? literals : 15) << 4;
+  if (literals >= 15)
+    o = putLength(out, o, literals - 15);
+  memcpy(out + o, in + anchor, literals);
+  return o + literals;
+}
+
+//false if the data is damaged and doesn't decode to exactly outSize bytes
+static bool lzDecompress(uint8_t* in, uint32_t inSize, uint8_t* out, uint32_t outSize) {
+  uint32_t i = 0;
+  uint32_t o = 0;
+  while (i < inSize) {
+    uint8_t token = in[i++];
+    uint32_t literals = token >> 4;
+    if (literals == 15 && !getLength(in, inSize, &i, &literals))
+      return false;
+    if (literals > inSize - i || literals > outSize - o)
+      return false;
+    memcpy(out + o, in + i, literals);
+    i += literals;
+    o += literals;
+    if (i == inSize)
+      break;
+    if (inSize - i < 2)
+      return false;
+    uint32_t offset = in[i] | (uint32_t)in[i + 1] << 8;
+    i += 2;
+    uint32_t length = token & 15;
+    if (length == 15 && !getLength(in, inSize, &i, &length))
+      return false;
+    length += lzMinMatch;
+    if (offset == 0 || offset > o || length > outSize - o)
+      return false;
+    //the match can overlap the bytes it produces, so it is copied byte by byte
+    for (uint32_t k = 0; k < length; k++) {
+      out[o + k] = out[o + k - offset];
+    }
+    o += length;
+  }
+  return o == outSize;
+}
+
+//0 in the checksum area means that the checksum of the block is not known, so it is never used as a checksum
+static uint32_t blockChecksum(FileSystem* fs, char* data) {
+  uint32_t crc = crc32c((uint8_t*)data, fs->blockSize);
+  return crc == 0 ? 1 : crc;
+}
+
+static void initChecksums(FileSystem* fs) {
+  ChecksumArea* cs = &fs->sums;
+  cs->start = fs->sb.checksumStart;
+  cs->blocks = fs->sb.inodeTableStart - fs->sb.checksumStart;
+  cs->firstCovered = fs->sb.inodeTableStart;
+  cs->entries = calloc(cs->blocks, sizeof(uint32_t*));
+  cs->dirty = calloc(cs->blocks, sizeof(bool));
+  if (cs->entries == NULL || cs->dirty == NULL)
+    failErrno(29, "Error allocating memory for the checksums");
+}
+
+//where the checksum of the block is kept in memory, NULL for the blocks before the inode table.
+//The blocks of the checksum area are read when they are first needed
+static uint32_t* checksumEntry(FileSystem* fs, int64_t block) {
+  ChecksumArea* cs = &fs->sums;
+  if (cs->entries == NULL || block < cs->firstCovered)
+    return NULL;
+  uint64_t index = block - cs->firstCovered;
+  uint64_t csBlock = index / checksumsPerBlock(fs);
+  if (csBlock >= cs->blocks)
+    return NULL;
+  if (cs->entries[csBlock] == NULL) {
+    cs->entries[csBlock] = allocBlocks(fs, 1);
+    if (cs->entries[csBlock] == NULL)
+      failErrno(29, "Error allocating memory for the checksums");
+    if (fs->map != NULL)
+      memcpy(cs->entries[csBlock], fs->map + (cs->start + csBlock) * fs->blockSize, fs->blockSize);
+    else
+      imagePread(fs, cs->entries[csBlock], fs->blockSize, (cs->start + csBlock) * fs->blockSize, 6, "Error reading the checksums");
+  }
+  return &cs->entries[csBlock][index % checksumsPerBlock(fs)];
+}
+
+static void setChecksum(FileSystem* fs, int64_t block, uint32_t checksum) {
+  uint32_t* entry = checksumEntry(fs, block);
+  if (entry != NULL && *entry != checksum) {
+    *entry = checksum;
+    bool* dirty = &fs->sums.dirty[(block - fs->sums.firstCovered) / checksumsPerBlock(fs)];
+    fs->sums.dirtyCount += !*dirty;
+    *dirty = true;
+  }
+}
+
+static bool checksumMatches(FileSystem* fs, int64_t block, char* data) {
+  uint32_t* entry = checksumEntry(fs, block);
+  return entry == NULL || *entry == 0 || *entry == blockChecksum(fs, data);
+}
+
+static void verifyBlock(FileSystem* fs, int64_t block, char* data) {
+  if (!checksumMatches(fs, block, data))
+    fail(31, "Checksum mismatch in block %lld of the file system", (long long)block);
+}
+
+static void freeChecksums(FileSystem* fs) {
+  ChecksumArea* cs = &fs->sums;
+  if (cs->entries == NULL)
+    return;
+  for (uint32_t i = 0; i < cs->blocks; i++) {
+    free(cs->entries[i]);
+  }
+  free(cs->entries);
+  free(cs->dirty);
+}
+
+//the words before the numbers of the blocks in the descriptor of a transaction
+#define journalHeaderWords 4
+
+static uint32_t descriptorBlocks(FileSystem* fs, uint32_t count) {
+  size_t bytes = (journalHeaderWords + (size_t)count) * sizeof(uint32_t);
+  return bytes / fs->blockSize + (bytes % fs->blockSize == 0 ? 0 : 1);
+}
+
+static bool journalEnabled(FileSystem* fs) {
+  return fs->journal.halfBlocks != 0;
+}
+
+//the journal is used only after its place is known, from the superblock or from mkfs
+static void setupJournal(FileSystem* fs) {
+  Journal* j = &fs->journal;
+  j->start = fs->sb.journalStart;
+  j->halfBlocks = fs->sb.journalBlocks / 2;
+  j->capacity = j->halfBlocks - 1;
+  while (j->capacity > 0 && descriptorBlocks(fs, j->capacity) + j->capacity > j->halfBlocks) {
+    j->capacity--;
+  }
+  j->sequence = 1;
+  j->count = 0;
+}
+
+//remembers the blocks of the transaction which is now in the half of the journal
+static void setHalfContents(FileSystem* fs, int half, uint32_t* blocks, uint32_t count) {
+  Journal* j = &fs->journal;
+  uint32_t imageBlocks = fs->sb.fsSize / fs->blockSize;
+  if (j->replayable == NULL)
+    j->replayable = calloc(imageBlocks / 64 + 1, sizeof(uint64_t));
+  uint32_t* contents = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+  holdMemory(&contents);
+  if (j->replayable == NULL || contents == NULL)
+    failErrno(29, "Error allocating memory for the journal");
+  memcpy(contents, blocks, count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < j->halfCounts[half]; i++) {
+    uint32_t block = j->halfContents[half][i];
+    j->replayable[block / 64] &= ~(1ULL << (block % 64));
+  }
+  free(j->halfContents[half]);
+  letGo(&contents);
+  j->halfContents[half] = contents;
+  j->halfCounts[half] = count;
+  //a block can be in both halves
+  for (int h = 0; h < 2; h++) {
+    for (uint32_t i = 0; i < j->halfCounts[h]; i++) {
+      uint32_t block = j->halfContents[h][i];
+      if (block < imageBlocks)
+        j->replayable[block / 64] |= 1ULL << (block % 64);
+    }
+  }
+}
+
+static bool isReplayable(FileSystem* fs, int64_t block) {
+  uint64_t* replayable = fs->journal.replayable;
+  return replayable != NULL && block < fs->sb.fsSize / fs->blockSize && (replayable[block / 64] >> (block % 64) & 1);
+}
+
+//a replay would bring back the old contents of a block written outside of the journal, e.g. of an
+//extent block which was freed and is now a datablock of a file. Such blocks are put in the next
+//transaction with what is in the image at the sync
+static void revokeReplay(FileSystem* fs, int64_t first, uint32_t count) {
+  Journal* j = &fs->journal;
+  for (int64_t block = first; block < first + count; block++) {
+    if (!isReplayable(fs, block))
+      continue;
+    if (j->revokedCount == j->revokedCapacity) {
+      uint32_t capacity = j->revokedCapacity * 2 + 16;
+      uint32_t* revoked = realloc(j->revoked, capacity * sizeof(uint32_t));
+      if (revoked == NULL)
+        failErrno(29, "Error allocating memory for the journal");
+      j->revoked = revoked;
+      j->revokedCapacity = capacity;
+    }
+    j->replayable[block / 64] &= ~(1ULL << (block % 64));
+    j->revoked[j->revokedCount++] = block;
+  }
+}
+
+//checks the transaction at the start of the given half and returns its descriptor followed by
+//the contents of its blocks, or NULL if there is no complete transaction there
+static uint32_t* readTransaction(FileSystem* fs, int half) {
+  Journal* j = &fs->journal;
+  int64_t first = j->start + (int64_t)half * j->halfBlocks;
+  uint32_t* header = malloc(fs->blockSize);
+  if (header == NULL)
+    failErrno(29, "Error allocating memory for the journal");
+  holdMemory(&header);
+  imagePread(fs, header, fs->blockSize, first * fs->blockSize, 6, "Error reading the journal");
+  if (header[0] != journalMagic || header[2] == 0 || header[2] > j->capacity) {
+    freeHeld(&header);
+    return NULL;
+  }
+  uint32_t descBlocks = descriptorBlocks(fs, header[2]);
+  uint32_t* transaction = realloc(header, (size_t)(descBlocks + header[2]) * fs->blockSize);
+  if (transaction == NULL)
+    failErrno(29, "Error allocating memory for the journal");
+  header = transaction;
+  imagePread(fs, transaction, (size_t)(descBlocks + transaction[2]) * fs->blockSize, first * fs->blockSize, 6, "Error reading the journal");
+  uint32_t checksum = transaction[3];
+  transaction[3] = 0;
+  uint32_t calculated = crc32c((uint8_t*)transaction, (size_t)descBlocks * fs->blockSize)
+    ^ crc32c((uint8_t*)transaction + (size_t)descBlocks * fs->blockSize, (size_t)transaction[2] * fs->blockSize);
+  if (calculated != checksum) {
+    freeHeld(&header);
+    return NULL;
+  }
+  letGo(&header);
+  return transaction;
+}
+
+static int compareBlockNumbers(const void* a, const void* b) {
+  uint32_t first = *(uint32_t*)a;
+  uint32_t second = *(uint32_t*)b;
+  return (first > second) - (first < second);
+}
+
+//writes the blocks of the transaction which differ from the ones in their place, returns how many
+//were written. Usually the image already has all of them and nothing is written. The blocks in
+//skipped (sorted) are left out, because a newer transaction has them too
+static uint32_t replayTransaction(FileSystem* fs, uint32_t* transaction, uint32_t* skipped, uint32_t skippedCount, int* writeFd) {
+  char* data = (char*)transaction + (size_t)descriptorBlocks(fs, transaction[2]) * fs->blockSize;
+  char block[fs->blockSize];
+  uint32_t written = 0;
+  for (uint32_t i = 0; i < transaction[2]; i++) {
+    uint32_t* home = &transaction[journalHeaderWords + i];
+    if (skippedCount > 0 && bsearch(home, skipped, skippedCount, sizeof(uint32_t), compareBlockNumbers) != NULL)
+      continue;
+    off_t offset = (off_t)*home * fs->blockSize;
+    imagePread(fs, block, fs->blockSize, offset, 6, "Error reading the file system while replaying the journal");
+    if (memcmp(block, data + (size_t)i * fs->blockSize, fs->blockSize) == 0)
+      continue;
+    //the read-only commands replay the journal too, through a descriptor opened only for that
+    if (*writeFd == -1) {
+      *writeFd = fs->fd;
+      if ((fcntl(fs->fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+        *writeFd = open(fs->path, O_RDWR);
+        holdFd(writeFd);
+      }
+      if (*writeFd == -1)
+        failErrno(32, "The journal has to be replayed, but the file system can't be opened for writing");
+    }
+    if (*writeFd == fs->fd)
+      imagePwrite(fs, data + (size_t)i * fs->blockSize, fs->blockSize, offset, 7, "Error writing the file system while replaying the journal");
+    else
+      safePwrite(*writeFd, data + (size_t)i * fs->blockSize, fs->blockSize, offset, 7, "Error writing the file system while replaying the journal");
+    written++;
+  }
+  return written;
+}
+
+//writes the collected transaction in the journal and waits for it to reach the disk - this is the
+//only fdatasync of a command. Then the blocks are written in their places without waiting:
+//the next transaction goes in the other half and its fdatasync covers these writes too, before
+//this transaction is overwritten
+static void commitTransaction(FileSystem* fs) {
+  Journal* j = &fs->journal;
+  if (j->count == 0)
+    return;
+  uint32_t descBlocks = descriptorBlocks(fs, j->count);
+  size_t used = (journalHeaderWords + (size_t)j->count) * sizeof(uint32_t);
+  memset((char*)j->descriptor + used, 0, (size_t)descBlocks * fs->blockSize - used);
+  j->descriptor[0] = journalMagic;
+  j->descriptor[1] = j->sequence;
+  j->descriptor[2] = j->count;
+  j->descriptor[3] = 0;
+  j->descriptor[3] = crc32c((uint8_t*)j->descriptor, (size_t)descBlocks * fs->blockSize)
+    ^ crc32c((uint8_t*)j->data, (size_t)j->count * fs->blockSize);
+  struct iovec iov[2] = {
+    {j->descriptor, (size_t)descBlocks * fs->blockSize},
+    {j->data, (size_t)j->count * fs->blockSize}
+  };
+  int64_t first = j->start + (int64_t)(j->sequence % 2) * j->halfBlocks;
+  imagePwritev(fs, iov, 2, first * fs->blockSize, 7, "Error writing the journal");
+  if (fdatasync(fs->fd) < 0)
+    failErrno(7, "Error syncing the journal");
+
+  uint32_t* blocks = j->descriptor + journalHeaderWords;
+  for (uint32_t i = 0; i < j->count; ) {
+    uint32_t run = 1;
+    while (i + run < j->count && blocks[i + run] == blocks[i] + run) {
+      run++;
+    }
+    char* data = j->data + (size_t)i * fs->blockSize;
+    imagePwrite(fs, data, (size_t)run * fs->blockSize, (off_t)blocks[i] * fs->blockSize, 7, "Error writing the file system after a commit");
+    //the private mapping has to see the blocks which were not changed through it, e.g. the bitmaps
+    if (fs->map != NULL)
+      memcpy(fs->map + (size_t)blocks[i] * fs->blockSize, data, (size_t)run * fs->blockSize);
+    i += run;
+  }
+  setHalfContents(fs, j->sequence % 2, blocks, j->count);
+  j->sequence++;
+  j->count = 0;
+}
+
+//adds a copy of the block to the transaction. A transaction is never committed in parts, syncFS
+//checks that it fits before anything is added
+static void journalBlock(FileSystem* fs, int64_t block, char* data) {
+  Journal* j = &fs->journal;
+  if (j->descriptor == NULL) {
+    j->descriptor = allocBlocks(fs, descriptorBlocks(fs, j->capacity));
+    j->data = allocBlocks(fs, j->capacity);
+    if (j->descriptor == NULL || j->data == NULL)
+      failErrno(29, "Error allocating memory for the journal");
+  }
+  if (j->count == j->capacity)
+    fail(35, "The changes since the last sync don't fit in the journal");
+  j->descriptor[journalHeaderWords + j->count] = block;
+  memcpy(j->data + (size_t)j->count * fs->blockSize, data, fs->blockSize);
+  j->count++;
+}
+
+static void freeJournal(FileSystem* fs) {
+  free(fs->journal.descriptor);
+  free(fs->journal.data);
+  free(fs->journal.halfContents[0]);
+  free(fs->journal.halfContents[1]);
+  free(fs->journal.replayable);
+  free(fs->journal.revoked);
+}
+
+static void initCache(FileSystem* fs) {
+  BlockCache* cache = &fs->cache;
+  cache->slotCount = defaultCacheBlocks;
+  char* blocks = getenv("BDSM_CACHE_BLOCKS");
+  if (blocks != NULL && atoi(blocks) >= 2) {
+    cache->slotCount = atoi(blocks);
+  }
+  //twice as many buckets as slots keeps the chains short
+  cache->bucketCount = cache->slotCount * 2;
+  cache->slots = malloc(cache->slotCount * sizeof(CacheSlot));
+  cache->buckets = calloc(cache->bucketCount, sizeof(CacheSlot*));
+  char* data = allocBlocks(fs, cache->slotCount);
+  if (cache->slots == NULL || cache->buckets == NULL || data == NULL) {
+    free(cache->slots);
+    free(cache->buckets);
+    free(data);
+    cache->slots = NULL;
+    cache->buckets = NULL;
+    failErrno(23, "Unable to allocate the block cache");
+  }
+  for (int i = 0; i < cache->slotCount; i++) {
+    cache->slots[i].block = -1;
+    cache->slots[i].dirty = false;
+    cache->slots[i].lastUsed = 0;
+    cache->slots[i].nextInBucket = NULL;
+    cache->slots[i].data = data + (size_t)i * fs->blockSize;
+  }
+  cache->data[cache->dataCount++] = data;
+  cache->clock = 0;
+}
+
+//doubles the slots of the cache. The slots move, so the buckets are filled again, but the data of
+//the blocks stays where it is
+static void growCache(FileSystem* fs) {
+  BlockCache* cache = &fs->cache;
+  int added = cache->slotCount;
+  if (cache->dataCount == maxCacheGrowth)
+    fail(23, "Unable to allocate the block cache");
+  CacheSlot* slots = realloc(cache->slots, (size_t)(cache->slotCount + added) * sizeof(CacheSlot));
+  if (slots == NULL)
+    failErrno(23, "Unable to allocate the block cache");
+  cache->slots = slots;
+  CacheSlot** buckets = calloc((size_t)(cache->slotCount + added) * 2, sizeof(CacheSlot*));
+  char* data = allocBlocks(fs, added);
+  if (buckets == NULL || data == NULL) {
+    free(buckets);
+    free(data);
+    failErrno(23, "Unable to allocate the block cache");
+  }
+  for (int i = cache->slotCount; i < cache->slotCount + added; i++) {
+    cache->slots[i].block = -1;
+    cache->slots[i].dirty = false;
+    cache->slots[i].lastUsed = 0;
+    cache->slots[i].data = data + (size_t)(i - cache->slotCount) * fs->blockSize;
+  }
+  cache->data[cache->dataCount++] = data;
+  cache->slotCount += added;
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucketCount = cache->slotCount * 2;
+  for (int i = 0; i < cache->slotCount; i++) {
+    CacheSlot* slot = &cache->slots[i];
+    slot->nextInBucket = NULL;
+    if (slot->block != -1) {
+      slot->nextInBucket = cache->buckets[slot->block % cache->bucketCount];
+      cache->buckets[slot->block % cache->bucketCount] = slot;
+    }
+  }
+}
+
+static int compareSlotsByBlock(const void* a, const void* b) {
+  int64_t first = (*(CacheSlot**)a)->block;
+  int64_t second = (*(CacheSlot**)b)->block;
+  return (first > second) - (first < second);
+}
+
+//writes all dirty blocks back to the image, neighbouring blocks are written with
+//a single pwritev so that a command ends with a few large writes instead of many small ones
+static void flushCache(FileSystem* fs) {
+  //the changes in a shared mapping are already in the image
+  if (fs->map != NULL)
+    return;
+  BlockCache* cache = &fs->cache;
+  CacheSlot** dirty = malloc(cache->slotCount * sizeof(CacheSlot*));
+  holdMemory(&dirty);
+  struct iovec* iov = malloc(cache->slotCount * sizeof(struct iovec));
+  holdMemory(&iov);
+  if (dirty == NULL || iov == NULL)
+    failErrno(23, "Error allocating memory for flushing the cache");
+  int dirtyCount = 0;
+  for (int i = 0; i < cache->slotCount; i++) {
+    if (cache->slots[i].block != -1 && cache->slots[i].dirty) {
+      dirty[dirtyCount++] = &cache->slots[i];
+    }
+  }
+  qsort(dirty, dirtyCount, sizeof(CacheSlot*), compareSlotsByBlock);
+
+  if (journalEnabled(fs)) {
+    for (int i = 0; i < dirtyCount; i++) {
+      dirty[i]->dirty = false;
+      setChecksum(fs, dirty[i]->block, blockChecksum(fs, dirty[i]->data));
+      journalBlock(fs, dirty[i]->block, dirty[i]->data);
+    }
+    dirtyCount = 0;
+  }
+  int runStart = 0;
+  while (runStart < dirtyCount) {
+    int runEnd = runStart + 1;
+    while (runEnd < dirtyCount && dirty[runEnd]->block == dirty[runEnd - 1]->block + 1) {
+      runEnd++;
+    }
+    for (int i = runStart; i < runEnd; i++) {
+      iov[i - runStart].iov_base = dirty[i]->data;
+      iov[i - runStart].iov_len = fs->blockSize;
+      dirty[i]->dirty = false;
+      setChecksum(fs, dirty[i]->block, blockChecksum(fs, dirty[i]->data));
+    }
+    imagePwritev(fs, iov, runEnd - runStart, dirty[runStart]->block * fs->blockSize, 7, "Error writing a block while flushing the cache");
+    runStart = runEnd;
+  }
+  cache->dirtyCount = 0;
+  freeHeld(&iov);
+  freeHeld(&dirty);
+}
+
+static CacheSlot* findCachedBlock(BlockCache* cache, int64_t block) {
+  CacheSlot* slot = cache->buckets[block % cache->bucketCount];
+  while (slot != NULL && slot->block != block) {
+    slot = slot->nextInBucket;
+  }
+  return slot;
+}
+
+static void removeFromBucket(BlockCache* cache, CacheSlot* slot) {
+  CacheSlot** link = &cache->buckets[slot->block % cache->bucketCount];
+  while (*link != slot) {
+    link = &(*link)->nextInBucket;
+  }
+  *link = slot->nextInBucket;
+}
+
+//returns the least recently used slot, ready to be filled with a new block
+static CacheSlot* evictSlot(FileSystem* fs) {
+  BlockCache* cache = &fs->cache;
+  //with the journal the changed blocks can't be written on their own, only as a transaction
+  //together with the bitmaps and the checksums, so only the clean slots are taken and when every
+  //slot is changed the cache grows - committing here would split the command in two transactions
+  bool keepDirty = journalEnabled(fs) && !fs->journal.inSync;
+  CacheSlot* victim = NULL;
+  for (int i = 0; i < cache->slotCount && (victim == NULL || victim->block != -1); i++) {
+    if (keepDirty && cache->slots[i].dirty)
+      continue;
+    if (victim == NULL || cache->slots[i].lastUsed < victim->lastUsed) {
+      victim = &cache->slots[i];
+    }
+  }
+  if (victim == NULL) {
+    growCache(fs);
+    return evictSlot(fs);
+  }
+  if (victim->block != -1) {
+    //writing back everything at once keeps the writes sequential when a command
+    //touches more blocks than the cache can hold, e.g. in mkfs
+    if (victim->dirty) {
+      flushCache(fs);
+    }
+    removeFromBucket(cache, victim);
+  }
+  return victim;
+}
+
+//the blocks are saved only while a call which changes the image runs, syncFS keeps what it changes
+static bool recordingChanges(FileSystem* fs) {
+  return fs->undo.active && !fs->journal.inSync;
+}
+
+static char* undoData(FileSystem* fs, UndoEntry* entry) {
+  return fs->undo.data + (size_t)entry->data * fs->blockSize;
+}
+
+//adds an entry at the end of the undo log, with a place for the copy of the block if copied
+static UndoEntry* addUndoEntry(FileSystem* fs, Bitmap* bitmap, int64_t block, bool copied, bool wasDirty) {
+  UndoLog* u = &fs->undo;
+  if (u->count == u->capacity) {
+    uint32_t capacity = u->capacity * 2 + 64;
+    UndoEntry* entries = realloc(u->entries, capacity * sizeof(UndoEntry));
+    if (entries == NULL)
+      failErrno(23, "Error allocating memory for the undo log");
+    u->entries = entries;
+    u->capacity = capacity;
+  }
+  if (copied && u->dataCount == u->dataCapacity) {
+    uint32_t capacity = u->dataCapacity * 2 + 16;
+    char* data = realloc(u->data, (size_t)capacity * fs->blockSize);
+    if (data == NULL)
+      failErrno(23, "Error allocating memory for the undo log");
+    u->data = data;
+    u->dataCapacity = capacity;
+  }
+  UndoEntry* entry = &u->entries[u->count++];
+  entry->bitmap = bitmap;
+  entry->block = block;
+  entry->copied = copied;
+  entry->wasDirty = wasDirty;
+  entry->data = copied ? u->dataCount++ : 0;
+  return entry;
+}
+
+//a slot which had no changes is only marked, one with changes from an earlier call is copied
+static void saveCachedBlock(FileSystem* fs, CacheSlot* slot) {
+  UndoEntry* entry = addUndoEntry(fs, NULL, slot->block, slot->dirty, slot->dirty);
+  if (entry->copied)
+    memcpy(undoData(fs, entry), slot->data, fs->blockSize);
+  slot->mark.call = fs->undo.call;
+  slot->mark.entry = fs->undo.count - 1;
+}
+
+//the mapping is private, so the old contents of a block are only in the copy
+static void saveMappedBlock(FileSystem* fs, int64_t block, bool wasDirty) {
+  UndoEntry* entry = addUndoEntry(fs, NULL, block, true, wasDirty);
+  memcpy(undoData(fs, entry), fs->map + block * fs->blockSize, fs->blockSize);
+  fs->undo.mapSaved[block / 64] |= 1ULL << (block % 64);
+}
+
+static void saveBitmapBlock(FileSystem* fs, Bitmap* bm, uint32_t index) {
+  UndoEntry* entry = addUndoEntry(fs, bm, index, true, bm->dirty[index]);
+  memcpy(undoData(fs, entry), (char*)bm->words + (size_t)index * bm->blockSize, bm->blockSize);
+  bm->marks[index].call = fs->undo.call;
+  bm->marks[index].entry = fs->undo.count - 1;
+}
+
+//returns a pointer to the cached copy of the given block of the image. The pointer is
+//valid until the next access to the cache, so callers copy what they need or use it right away.
+//If readFromDisk is false, the block is going to be overwritten completely and is not read
+static char* cacheBlock(FileSystem* fs, int64_t block, bool forWrite, bool readFromDisk) {
+  if (fs->map != NULL) {
+    if ((block + 1) * fs->blockSize > (int64_t)fs->mapSize)
+      fail(4, "Trying to access a block outside of the image");
+    uint64_t bit = 1ULL << (block % 64);
+    //the changed blocks are checked again only after syncFS calculates their new checksums
+    if (readFromDisk && !(fs->mapDirty[block / 64] & bit) && !(fs->mapVerified[block / 64] & bit)) {
+      verifyBlock(fs, block, fs->map + block * fs->blockSize);
+      fs->mapVerified[block / 64] |= bit;
+    }
+    if (forWrite && recordingChanges(fs) && !(fs->undo.mapSaved[block / 64] & bit))
+      saveMappedBlock(fs, block, fs->mapDirty[block / 64] & bit);
+    if (forWrite && !(fs->mapDirty[block / 64] & bit)) {
+      fs->mapDirty[block / 64] |= bit;
+      fs->mapDirtyCount++;
+    }
+    return fs->map + block * fs->blockSize;
+  }
+  BlockCache* cache = &fs->cache;
+  CacheSlot* slot = findCachedBlock(cache, block);
+  if (slot == NULL) {
+    slot = evictSlot(fs);
+    slot->block = block;
+    slot->dirty = false;
+    slot->mark.call = 0;
+    slot->nextInBucket = cache->buckets[block % cache->bucketCount];
+    cache->buckets[block % cache->bucketCount] = slot;
+    //blocks past the end of the image read as zeroes
+    memset(slot->data, 0, fs->blockSize);
+    if (readFromDisk) {
+      imagePread(fs, slot->data, fs->blockSize, block * fs->blockSize, 6, "Error reading a block of the file system");
+      verifyBlock(fs, block, slot->data);
+    }
+  }
+  slot->lastUsed = ++cache->clock;
+  if (forWrite && recordingChanges(fs) && slot->mark.call != fs->undo.call)
+    saveCachedBlock(fs, slot);
+  if (forWrite && !slot->dirty) {
+    slot->dirty = true;
+    cache->dirtyCount++;
+  }
+  return slot->data;
+}
+
+static char* getBlock(FileSystem* fs, int64_t block) {
+  return cacheBlock(fs, block, false, true);
+}
+
+static char* getBlockForWrite(FileSystem* fs, int64_t block) {
+  return cacheBlock(fs, block, true, true);
+}
+
+//used for blocks which will be overwritten as a whole, so reading them first is pointless
+static char* getNewBlock(FileSystem* fs, int64_t block) {
+  return cacheBlock(fs, block, true, false);
+}
+
+//forgets the cached copy of a block which is written directly in the image, otherwise
+//a stale dirty copy would overwrite the new data when the cache is flushed
+static void dropCachedBlock(FileSystem* fs, int64_t block) {
+  CacheSlot* slot = findCachedBlock(&fs->cache, block);
+  if (slot != NULL) {
+    removeFromBucket(&fs->cache, slot);
+    fs->cache.dirtyCount -= slot->dirty;
+    slot->block = -1;
+    slot->dirty = false;
+    slot->lastUsed = 0;
+  }
+}
+
+//writes count neighbouring blocks starting from first, bypassing the cache
+static void writeBlockRun(FileSystem* fs, int64_t first, int count, char* buffer) {
+  for (int i = 0; i < count; i++) {
+    setChecksum(fs, first + i, blockChecksum(fs, buffer + (size_t)i * fs->blockSize));
+  }
+  revokeReplay(fs, first, count);
+  if (fs->map != NULL) {
+    //only checks that the whole run is inside the image, the mapping is private, so the blocks
+    //are written in the file too
+    cacheBlock(fs, first + count - 1, false, false);
+    memcpy(fs->map + first * fs->blockSize, buffer, (size_t)count * fs->blockSize);
+  }
+  for (int i = 0; fs->map == NULL && i < count; i++) {
+    dropCachedBlock(fs, first + i);
+  }
+  BlockRun run = {first, count};
+  transferRuns(fs, &fs->io, true, &run, 1, buffer);
+}
+
+//reads the runs one after another in buffer, all of them in flight at once. The blocks which are
+//in the cache are taken from there, because they may have changes which are not written yet
+static void readBlockRuns(FileSystem* fs, IoQueue* q, BlockRun* runs, int count, char* buffer) {
+  if (fs->map != NULL) {
+    for (int i = 0; i < count; i++) {
+      cacheBlock(fs, runs[i].first + runs[i].count - 1, false, false);
+      memcpy(buffer, fs->map + runs[i].first * fs->blockSize, (size_t)runs[i].count * fs->blockSize);
+      buffer += (size_t)runs[i].count * fs->blockSize;
+    }
+    return;
+  }
+  transferRuns(fs, q, false, runs, count, buffer);
+  for (int i = 0; i < count; i++) {
+    for (uint32_t j = 0; j < runs[i].count; j++) {
+      CacheSlot* slot = findCachedBlock(&fs->cache, runs[i].first + j);
+      if (slot != NULL) {
+        memcpy(buffer + (size_t)j * fs->blockSize, slot->data, fs->blockSize);
+      }
+    }
+    buffer += (size_t)runs[i].count * fs->blockSize;
+  }
+}
+
+//reads count neighbouring blocks starting from first, with a single read if they fit in one request
+static void readBlockRun(FileSystem* fs, int64_t first, int count, char* buffer) {
+  BlockRun run = {first, count};
+  readBlockRuns(fs, &fs->io, &run, 1, buffer);
+}
+
+//bits past the end of the bitmap are always set, so they are never given away
+static void initBitmap(FileSystem* fs, Bitmap* bm, uint32_t start, uint32_t blocks, uint32_t bits) {
+  bm->start = start;
+  bm->blocks = blocks;
+  bm->blockSize = fs->blockSize;
+  bm->bits = bits;
+  bm->hint = 0;
+  bm->dirtyCount = 0;
+  bm->words = allocBlocks(fs, blocks);
+  bm->dirty = calloc(blocks, sizeof(bool));
+  bm->marks = calloc(blocks, sizeof(UndoMark));
+  if (bm->words == NULL || bm->dirty == NULL || bm->marks == NULL)
+    failErrno(29, "Error allocating memory for the bitmaps");
+  memset(bm->words, 0, (size_t)blocks * fs->blockSize);
+}
+
+static void setBitmapPadding(Bitmap* bm) {
+  for (uint64_t bit = bm->bits; bit < (uint64_t)bm->blocks * bm->blockSize * 8; bit++) {
+    bm->words[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+static void loadBitmap(FileSystem* fs, Bitmap* bm, uint32_t start, uint32_t blocks, uint32_t bits) {
+  initBitmap(fs, bm, start, blocks, bits);
+  readBlockRun(fs, start, blocks, (char*)bm->words);
+  setBitmapPadding(bm);
+}
+
+//the bitmaps are read the first time something is allocated, freed or checked
+static void loadBitmaps(FileSystem* fs) {
+  if (fs->bitmapsLoaded)
+    return;
+  Superblock* sb = &fs->sb;
+  loadBitmap(fs, &fs->inodeBitmap, sb->inodeBitmapStart, sb->blockBitmapStart - sb->inodeBitmapStart, sb->inodeCount);
+  loadBitmap(fs, &fs->blockBitmap, sb->blockBitmapStart, sb->checksumStart - sb->blockBitmapStart, sb->dataBlocks);
+  fs->bitmapsLoaded = true;
+}
+
+//the bitmaps and the checksums go in the journal if there is one
+static void writeMetadataRun(FileSystem* fs, int64_t first, int count, char* buffer) {
+  if (!journalEnabled(fs)) {
+    writeBlockRun(fs, first, count, buffer);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    journalBlock(fs, first + i, buffer + (size_t)i * fs->blockSize);
+  }
+}
+
+//writes the changed blocks of the bitmap, neighbouring ones with a single write
+static void syncBitmap(FileSystem* fs, Bitmap* bm) {
+  for (uint32_t first = 0; first < bm->blocks; first++) {
+    if (!bm->dirty[first])
+      continue;
+    uint32_t count = 1;
+    while (first + count < bm->blocks && bm->dirty[first + count]) {
+      bm->dirty[first + count] = false;
+      count++;
+    }
+    bm->dirty[first] = false;
+    writeMetadataRun(fs, bm->start + first, count, (char*)bm->words + (size_t)first * fs->blockSize);
+    first += count - 1;
+  }
+  bm->dirtyCount = 0;
+}
+
+static void freeBitmap(Bitmap* bm) {
+  free(bm->words);
+  free(bm->dirty);
+  free(bm->marks);
+}
+
+static void setBits(FileSystem* fs, Bitmap* bm, uint32_t first, uint32_t count, bool used) {
+  for (uint32_t bit = first; bit < first + count; bit++) {
+    uint32_t index = bit / (bm->blockSize * 8);
+    if (recordingChanges(fs) && bm->marks[index].call != fs->undo.call)
+      saveBitmapBlock(fs, bm, index);
+    if (used)
+      bm->words[bit / 64] |= 1ULL << (bit % 64);
+    else
+      bm->words[bit / 64] &= ~(1ULL << (bit % 64));
+    bool* dirty = &bm->dirty[index];
+    bm->dirtyCount += !*dirty;
+    *dirty = true;
+  }
+  if (!used && first < bm->hint)
+    bm->hint = first;
+}
+
+//the first word from start which has a free bit. With SSE2 four words are compared at once
+static uint32_t skipFullWords(uint64_t* words, uint32_t start, uint32_t count) {
+#ifdef __SSE2__
+  __m128i full = _mm_set1_epi32(-1);
+  while (start + 4 <= count) {
+    __m128i both = _mm_and_si128(_mm_loadu_si128((__m128i*)(words + start)),
+                                 _mm_loadu_si128((__m128i*)(words + start + 2)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(both, full)) != 0xFFFF)
+      break;
+    start += 4;
+  }
+#endif
+  while (start < count && words[start] == UINT64_MAX)
+    start++;
+  return start;
+}
+
+//the first free bit from start, -1 if there is none
+static int64_t findFreeBit(Bitmap* bm, uint32_t start) {
+  uint32_t wordCount = bm->blocks * (bm->blockSize / sizeof(uint64_t));
+  uint32_t w = start / 64;
+  if (start >= bm->bits)
+    return -1;
+  //the bits before start are treated as used
+  uint64_t word = bm->words[w] | ((1ULL << (start % 64)) - 1);
+  while (word == UINT64_MAX) {
+    w = skipFullWords(bm->words, w + 1, wordCount);
+    if (w == wordCount)
+      return -1;
+    word = bm->words[w];
+  }
+  return (int64_t)w * 64 + __builtin_ctzll(~word);
+}
+
+//how many free bits there are from start, but not more than limit
+static uint32_t freeRunLength(Bitmap* bm, uint32_t start, uint32_t limit) {
+  uint32_t length = 0;
+  if (limit > bm->bits - start)
+    limit = bm->bits - start;
+  while (length < limit) {
+    uint32_t bit = start + length;
+    uint64_t word = bm->words[bit / 64] >> (bit % 64);
+    if (word != 0) {
+      length += __builtin_ctzll(word);
+      break;
+    }
+    length += 64 - bit % 64;
+  }
+  return length < limit ? length : limit;
+}
+
+//checks the blocks read with readBlockRun, the ones with changes which are not written yet are skipped
+static void verifyBlockRun(FileSystem* fs, int64_t first, int count, char* buffer) {
+  for (int i = 0; i < count; i++) {
+    int64_t block = first + i;
+    if (fs->map != NULL) {
+      if (fs->mapDirty[block / 64] & (1ULL << (block % 64)))
+        continue;
+    } else {
+      CacheSlot* slot = findCachedBlock(&fs->cache, block);
+      if (slot != NULL && slot->dirty)
+        continue;
+    }
+    verifyBlock(fs, block, buffer + (size_t)i * fs->blockSize);
+  }
+}
+
+//writes the changed blocks of the checksum area
+static void syncChecksums(FileSystem* fs) {
+  ChecksumArea* cs = &fs->sums;
+  for (uint32_t i = 0; i < cs->blocks; i++) {
+    if (cs->dirty[i]) {
+      writeMetadataRun(fs, cs->start + i, 1, (char*)cs->entries[i]);
+      cs->dirty[i] = false;
+    }
+  }
+  cs->dirtyCount = 0;
+}
+
+static void markSuperblockDirty(FileSystem* fs) {
+  fs->sbDirty = true;
+}
+
+//the most blocks the next transaction can have - the revoked blocks, the changed blocks of the
+//bitmaps, the cache (or the mapping) and the superblock, and the blocks of the checksum area which
+//hold the checksums of the changed blocks. A quick bound is returned if it isn't above limit, the
+//blocks of the checksum area are counted one by one only when it is
+static uint64_t pendingJournalBlocks(FileSystem* fs, uint64_t limit) {
+  uint64_t changed = fs->map != NULL ? fs->mapDirtyCount : (uint64_t)fs->cache.dirtyCount;
+  uint64_t blocks = fs->journal.revokedCount + changed + (fs->sbDirty ? 1 : 0);
+  if (fs->bitmapsLoaded)
+    blocks += fs->inodeBitmap.dirtyCount + fs->blockBitmap.dirtyCount;
+  ChecksumArea* cs = &fs->sums;
+  if (cs->entries == NULL)
+    return blocks;
+  if (blocks + cs->dirtyCount + changed <= limit)
+    return blocks + cs->dirtyCount + changed;
+  bool* touched = malloc(cs->blocks * sizeof(bool));
+  if (touched == NULL)
+    failErrno(29, "Error allocating memory for the journal");
+  memcpy(touched, cs->dirty, cs->blocks * sizeof(bool));
+  uint64_t sums = cs->dirtyCount;
+  uint64_t imageBlocks = fs->map != NULL ? fs->mapSize / fs->blockSize : (uint64_t)fs->cache.slotCount;
+  for (uint64_t i = 0; i < imageBlocks; i++) {
+    int64_t block;
+    if (fs->map != NULL) {
+      if (fs->mapDirty[i / 64] == 0) {
+        i += 63 - i % 64;
+        continue;
+      }
+      if (!(fs->mapDirty[i / 64] & (1ULL << (i % 64))))
+        continue;
+      block = i;
+    } else {
+      if (fs->cache.slots[i].block == -1 || !fs->cache.slots[i].dirty)
+        continue;
+      block = fs->cache.slots[i].block;
+    }
+    if (block < cs->firstCovered)
+      continue;
+    uint64_t index = (block - cs->firstCovered) / checksumsPerBlock(fs);
+    if (index < cs->blocks && !touched[index]) {
+      touched[index] = true;
+      sums++;
+    }
+  }
+  free(touched);
+  return blocks + sums;
+}
+
+//called before a sync and at the end of every command which changes the image, so that changes
+//which can't be a single transaction fail the command before any of them is committed
+static void checkJournalSpace(FileSystem* fs) {
+  if (journalEnabled(fs) && pendingJournalBlocks(fs, fs->journal.capacity) > fs->journal.capacity)
+    fail(35, "The changes since the last sync don't fit in the journal");
+}
+
+//defined with the rest of the functions which open and close the image
+static void syncFS(FileSystem* fs);
+
+//the commands of a batch are collected in one transaction until a sync, but when it fills a quarter of
+//the journal it is committed before the next command starts. So the transactions end only between
+//commands and every command has at least three quarters of the journal for its changes
+static bool journalFilling(FileSystem* fs) {
+  return journalEnabled(fs) && pendingJournalBlocks(fs, fs->journal.capacity / 4) > fs->journal.capacity / 4;
+}
+
+static void makeJournalRoom(FileSystem* fs) {
+  if (journalFilling(fs))
+    syncFS(fs);
+}
+
+static void releaseFreed(FileSystem* fs);
+
+//forgets the saved blocks and keeps the changes so far, the call goes on from here
+static void keepChanges(FileSystem* fs) {
+  UndoLog* u = &fs->undo;
+  for (uint32_t i = 0; fs->map != NULL && i < u->count; i++) {
+    if (u->entries[i].bitmap == NULL)
+      u->mapSaved[u->entries[i].block / 64] &= ~(1ULL << (u->entries[i].block % 64));
+  }
+  releaseFreed(fs);
+  u->count = 0;
+  u->dataCount = 0;
+  u->call++;
+  u->sb = fs->sb;
+  u->sbDirty = fs->sbDirty;
+}
+
+static void beginChange(FileSystem* fs) {
+  keepChanges(fs);
+  fs->undo.active = true;
+}
+
+static void endChange(FileSystem* fs) {
+  keepChanges(fs);
+  fs->undo.active = false;
+}
+
+//puts back what a failed call changed in memory. The datablocks it wrote directly in the image
+//stay changed - the new ones are free again and only the data written over the blocks of a file
+//stays. It can't fail: the copies go back in the cache after the slots of the blocks which had no
+//changes are free, so there is a clean slot for each of them
+static void rollBack(FileSystem* fs) {
+  UndoLog* u = &fs->undo;
+  if (!u->active)
+    return;
+  u->active = false;
+  u->freedCount = 0;
+  fs->journal.inSync = false;
+  //from the end, so that the first copy of a block saved twice is the one which stays
+  for (uint32_t i = u->count; i > 0; i--) {
+    UndoEntry* entry = &u->entries[i - 1];
+    char* data = undoData(fs, entry);
+    if (entry->bitmap != NULL) {
+      Bitmap* bm = entry->bitmap;
+      memcpy((char*)bm->words + (size_t)entry->block * bm->blockSize, data, bm->blockSize);
+      bm->dirtyCount -= bm->dirty[entry->block];
+      bm->dirtyCount += entry->wasDirty;
+      bm->dirty[entry->block] = entry->wasDirty;
+      bm->hint = 0;
+    } else if (fs->map != NULL) {
+      memcpy(fs->map + entry->block * fs->blockSize, data, fs->blockSize);
+      uint64_t bit = 1ULL << (entry->block % 64);
+      fs->mapDirtyCount -= (fs->mapDirty[entry->block / 64] & bit) != 0;
+      fs->mapDirtyCount += entry->wasDirty;
+      if (entry->wasDirty)
+        fs->mapDirty[entry->block / 64] |= bit;
+      else
+        fs->mapDirty[entry->block / 64] &= ~bit;
+    } else if (!entry->copied) {
+      dropCachedBlock(fs, entry->block);
+    }
+  }
+  for (uint32_t i = u->count; fs->map == NULL && i > 0; i--) {
+    UndoEntry* entry = &u->entries[i - 1];
+    if (entry->bitmap == NULL && entry->copied)
+      memcpy(cacheBlock(fs, entry->block, true, false), undoData(fs, entry), fs->blockSize);
+  }
+  fs->sb = u->sb;
+  fs->sbDirty = u->sbDirty;
+  //the names looked up by the call may be gone
+  for (int i = 0; i < dentryCacheSize; i++) {
+    fs->dentries[i].parent = -1;
+  }
+  keepChanges(fs);
+}
+
+//writes the superblock, the changed parts of the bitmaps and every dirty block to the image,
+//as a single transaction of the journal
+static void syncFS(FileSystem* fs) {
+  releaseFreed(fs);
+  checkJournalSpace(fs);
+  fs->journal.inSync = true;
+  //the revoked blocks come first, the changed blocks in the cache or the mapping are newer
+  Journal* j = &fs->journal;
+  for (uint32_t i = 0; i < j->revokedCount; i++) {
+    char block[fs->blockSize];
+    char* data = block;
+    if (fs->map != NULL)
+      data = fs->map + (size_t)j->revoked[i] * fs->blockSize;
+    else
+      imagePread(fs, block, fs->blockSize, (off_t)j->revoked[i] * fs->blockSize, 6, "Error reading a block of the file system");
+    journalBlock(fs, j->revoked[i], data);
+  }
+  j->revokedCount = 0;
+  if (fs->bitmapsLoaded) {
+    syncBitmap(fs, &fs->inodeBitmap);
+    syncBitmap(fs, &fs->blockBitmap);
+  }
+  if (fs->sbDirty) {
+    fs->sb.checkSum = 0;
+    fs->sb.checkSum = Fletcher16((uint8_t*)&fs->sb, sizeof(fs->sb));
+    memcpy(getBlockForWrite(fs, 0), &fs->sb, sizeof(fs->sb));
+    fs->sbDirty = false;
+  }
+  if (fs->map != NULL) {
+    //the blocks changed through the mapping get their checksums now
+    for (size_t i = 0; i < fs->mapSize / fs->blockSize; i++) {
+      if (fs->mapDirty[i / 64] == 0)
+        i += 63 - i % 64;
+      else if (fs->mapDirty[i / 64] & (1ULL << (i % 64))) {
+        setChecksum(fs, i, blockChecksum(fs, fs->map + i * fs->blockSize));
+        if (journalEnabled(fs))
+          journalBlock(fs, i, fs->map + i * fs->blockSize);
+        else
+          imagePwrite(fs, fs->map + i * fs->blockSize, fs->blockSize, i * fs->blockSize, 7, "Error writing a block of the file system");
+      }
+    }
+    memset(fs->mapDirty, 0, (fs->mapSize / fs->blockSize / 64 + 1) * sizeof(uint64_t));
+    fs->mapDirtyCount = 0;
+  }
+  flushCache(fs);
+  if (fs->sums.entries != NULL)
+    syncChecksums(fs);
+  commitTransaction(fs);
+  fs->journal.inSync = false;
+  keepChanges(fs);
+}
+
+static bool validBlockSize(uint32_t size) {
+  return size >= minBlockSize && size <= maxBlockSize && (size & (size - 1)) == 0;
+}
+
+//BDSM_BLOCK_SIZE, read only by mkfs
+static uint32_t requestedBlockSize(void) {
+  char* size = getenv("BDSM_BLOCK_SIZE");
+  if (size == NULL)
+    return defaultBlockSize;
+  char* end;
+  unsigned long value = strtoul(size, &end, 10);
+  if (*size == '\0' || *end != '\0' || value > maxBlockSize || !validBlockSize(value))
+    fail(1, "BDSM_BLOCK_SIZE must be a power of two from %d to %d", minBlockSize, maxBlockSize);
+  return value;
+}
+
+//the block size of an existing image is in its superblock, which starts every image and is read
+//before anything else. An image of another version is opened with the default block size, so
+//that checkVersion can tell what is wrong
+static void readBlockSize(FileSystem* fs) {
+  Superblock sb;
+  safePread(fs->fd, &sb, sizeof(sb), 0, 6, "Error reading the superblock");
+  fs->blockSize = defaultBlockSize;
+  if (sb.fsType == fsVersion) {
+    if (!validBlockSize(sb.blockSize))
+      fail(10, "The file system is corrupted");
+    fs->blockSize = sb.blockSize;
+  }
+}
+
+//fs has to be filled with zeroes, so that releaseFS knows what to free if opening fails.
+//With format the image is about to be made by mkfs, so nothing is read from it
+static void openFS(FileSystem* fs, char image[], int flag, bool format) {
+  fs->fd = -1;
+  fs->path = strdup(image);
+  if (fs->path == NULL)
+    failErrno(23, "Error allocating memory for the name of the image");
+  fs->fd = open(image, flag);
+  if (fs->fd == -1){
+      failErrno(2,"BDSM file cannot be opened");
+  }
+  fs->readOnly = (flag & O_ACCMODE) == O_RDONLY;
+  if (format)
+    fs->blockSize = requestedBlockSize();
+  else
+    readBlockSize(fs);
+  fs->sbDirty = false;
+  fs->bitmapsLoaded = false;
+  fs->dentries = malloc(dentryCacheSize * sizeof(DentryCacheEntry));
+  if (fs->dentries == NULL)
+    failErrno(23, "Error allocating memory for the dentry cache");
+  for (int i = 0; i < dentryCacheSize; i++) {
+    fs->dentries[i].parent = -1;
+  }
+  fs->dentryHits = 0;
+  fs->dentryMisses = 0;
+  memset(&fs->sums, 0, sizeof(fs->sums));
+  memset(&fs->journal, 0, sizeof(fs->journal));
+  fs->map = NULL;
+  char* backend = getenv("BDSM_IO");
+  if (backend != NULL && strcmp(backend, "mmap") == 0) {
+    //read-only commands get a read-only mapping, so a stray write crashes instead of corrupting the image
+    int protection = (flag & O_ACCMODE) == O_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    fs->mapSize = getSize(fs);
+    //the changes of the other commands must not reach the image before they are in the journal
+    int sharing = (flag & O_ACCMODE) == O_RDONLY ? MAP_SHARED : MAP_PRIVATE;
+    char* map = mmap(NULL, fs->mapSize, protection, sharing, fs->fd, 0);
+    if (map == MAP_FAILED)
+      failErrno(26, "Error mapping the BDSM file in memory");
+    fs->map = map;
+    fs->mapDirty = calloc(fs->mapSize / fs->blockSize / 64 + 1, sizeof(uint64_t));
+    fs->mapVerified = calloc(fs->mapSize / fs->blockSize / 64 + 1, sizeof(uint64_t));
+    fs->undo.mapSaved = calloc(fs->mapSize / fs->blockSize / 64 + 1, sizeof(uint64_t));
+    if (fs->mapDirty == NULL || fs->mapVerified == NULL || fs->undo.mapSaved == NULL)
+      failErrno(29, "Error allocating memory for the checksums");
+  } else if (backend != NULL && strcmp(backend, "cache") != 0 && strcmp(backend, "direct") != 0) {
+    fail(1, "BDSM_IO must be cache, mmap or direct");
+  } else {
+    //direct goes through the cache as well, but the page cache of the kernel is bypassed
+    if (backend != NULL && strcmp(backend, "direct") == 0) {
+      int flags = fcntl(fs->fd, F_GETFL);
+      if (flags == -1 || fcntl(fs->fd, F_SETFL, flags | O_DIRECT) == -1)
+        failErrno(2, "BDSM file cannot be opened with O_DIRECT");
+      fs->direct = true;
+    }
+    initCache(fs);
+  }
+  memcpy(&fs->sb, getBlock(fs, 0), sizeof(fs->sb));
+}
+
+//frees everything openFS and the commands allocated, without writing anything
+static void releaseFS(FileSystem* fs) {
+  if (fs->bitmapsLoaded) {
+    freeBitmap(&fs->inodeBitmap);
+    freeBitmap(&fs->blockBitmap);
+  }
+  free(fs->dentries);
+  stopIoQueue(&fs->io);
+  freeChecksums(fs);
+  freeJournal(fs);
+  free(fs->undo.entries);
+  free(fs->undo.data);
+  free(fs->undo.freed);
+  if (fs->map != NULL) {
+    munmap(fs->map, fs->mapSize);
+    free(fs->mapDirty);
+    free(fs->mapVerified);
+    free(fs->undo.mapSaved);
+  } else if (fs->cache.slots != NULL) {
+    for (int i = 0; i < fs->cache.dataCount; i++) {
+      free(fs->cache.data[i]);
+    }
+    free(fs->cache.slots);
+    free(fs->cache.buckets);
+  }
+  if (fs->fd != -1)
+    close(fs->fd);
+  free(fs->path);
+}
+
+static void checkVersion(FileSystem* fs) {
+  if (fs->sb.fsType != fsVersion)
+    fail(27, "The file system was created by a different version of bdsm, run mkfs again");
+}
+
+//called when an image is opened - the transactions still in the journal are written in their
+//places again, older first, in case the command which committed them didn't manage to finish
+static void initJournal(FileSystem* fs) {
+  setupJournal(fs);
+  uint32_t* transactions[2] = {readTransaction(fs, 0), NULL};
+  holdMemory(&transactions[0]);
+  transactions[1] = readTransaction(fs, 1);
+  holdMemory(&transactions[1]);
+  int order[2] = {0, 1};
+  if (transactions[0] != NULL && transactions[1] != NULL && transactions[0][1] > transactions[1][1]) {
+    order[0] = 1;
+    order[1] = 0;
+  }
+  //the blocks of the newer transaction, which the older one doesn't have to write
+  uint32_t* newer = transactions[order[1]];
+  uint32_t* skipped = NULL;
+  uint32_t skippedCount = 0;
+  if (transactions[order[0]] != NULL && newer != NULL) {
+    skippedCount = newer[2];
+    skipped = malloc(skippedCount * sizeof(uint32_t));
+    if (skipped == NULL)
+      failErrno(29, "Error allocating memory for the journal");
+    holdMemory(&skipped);
+    memcpy(skipped, newer + journalHeaderWords, skippedCount * sizeof(uint32_t));
+    qsort(skipped, skippedCount, sizeof(uint32_t), compareBlockNumbers);
+  }
+  int writeFd = -1;
+  uint32_t written = 0;
+  for (int i = 0; i < 2; i++) {
+    uint32_t* transaction = transactions[order[i]];
+    if (transaction == NULL)
+      continue;
+    written += replayTransaction(fs, transaction, i == 0 ? skipped : NULL, i == 0 ? skippedCount : 0, &writeFd);
+    if (transaction[1] >= fs->journal.sequence)
+      fs->journal.sequence = transaction[1] + 1;
+    setHalfContents(fs, order[i], transaction + journalHeaderWords, transaction[2]);
+    freeHeld(&transactions[order[i]]);
+  }
+  if (skipped != NULL)
+    freeHeld(&skipped);
+  letGo(&transactions[1]);
+  letGo(&transactions[0]);
+  if (written == 0)
+    return;
+  if (fdatasync(writeFd) < 0)
+    failErrno(7, "Error syncing the replayed journal");
+  if (writeFd != fs->fd) {
+    letGo(&writeFd);
+    close(writeFd);
+  }
+  fs->replayedBlocks = written;
+  //the superblock may have been one of them
+  if (fs->map == NULL) {
+    CacheSlot* slot = findCachedBlock(&fs->cache, 0);
+    if (slot != NULL)
+      imagePread(fs, slot->data, fs->blockSize, 0, 6, "Error reading the superblock");
+  }
+  memcpy(&fs->sb, getBlock(fs, 0), sizeof(fs->sb));
+}
+
+static int datablocksForInodes(Superblock* sb) {
+  return sb->inodeCount / sb->inodesPerDatablock + (sb->inodeCount % sb->inodesPerDatablock == 0 ? 0 : 1);
+}
+
+//the number of blocks needed for a bitmap with the given number of bits
+static uint32_t bitmapBlocks(FileSystem* fs, uint32_t bits) {
+  return bits / (fs->blockSize * 8) + (bits % (fs->blockSize * 8) == 0 ? 0 : 1);
+}
+
+//the number of the block in the image which holds the given datablock
+static int64_t datablockPosition(FileSystem* fs, int db) {
+  return fs->sb.firstDatablock + (int64_t)db;
+}
+
+static char* locateDatablock(FileSystem* fs, int db, bool forWrite) {
+  int64_t block = datablockPosition(fs, db);
+  return forWrite ? getBlockForWrite(fs, block) : getBlock(fs, block);
+}
+
+static Inode* locateInode(FileSystem* fs, uint32_t inodeId, bool forWrite) {
+  int64_t block = fs->sb.inodeTableStart + inodeId / fs->sb.inodesPerDatablock;
+  char* data = forWrite ? getBlockForWrite(fs, block) : getBlock(fs, block);
+  return (Inode*)(data + (inodeId % fs->sb.inodesPerDatablock) * sizeof(Inode));
+}
+
+static void readInode(FileSystem* fs, uint32_t inodeId, Inode* in) {
+  *in = *locateInode(fs, inodeId, false);
+}
+
+static void updateInode(FileSystem* fs, Inode* in) {
+  *locateInode(fs, in->id, true) = *in;
+}
+
+//fills count blocks of the inode table starting from firstBlock with empty inodes
+static void writeInodes(FileSystem* fs, uint32_t firstBlock, uint32_t count) {
+  Superblock* sb = &fs->sb;
+  Inode inode;
+  memset(&inode, 0, sizeof(inode));
+  inode.permissions = 644;
+  inode.mod_time = time(NULL);
+  for (int i = 0; i < inodeExtents; i++) {
+    inode.extents[i].start = -1;
+    inode.extents[i].length = 0;
+  } 
+  inode.indirect = -1;
+
+  //the inodes are prepared for inodeChunkBytes at once and written with a single write,
+  //every inode block is written as a whole, the inodes never cross a block boundary
+  uint32_t chunkBlocks = count < inodeChunkBlocks(fs) ? count : inodeChunkBlocks(fs);
+  char* chunk = allocBlocks(fs, chunkBlocks);
+  if (chunk == NULL)
+    failErrno(23, "Error allocating memory for the inodes");
+  holdMemory(&chunk);
+  for (uint32_t done = 0; done < count; done += chunkBlocks) {
+    uint32_t blocks = count - done < chunkBlocks ? count - done : chunkBlocks;
+    memset(chunk, 0, (size_t)blocks * fs->blockSize);
+    uint32_t first = (firstBlock + done) * sb->inodesPerDatablock;
+    for (uint32_t i = first; i < first + blocks * sb->inodesPerDatablock && i < sb->inodeCount; i++) {
+      inode.id = i;
+      Inode* block = (Inode*)(chunk + (size_t)((i - first) / sb->inodesPerDatablock) * fs->blockSize);
+      block[i % sb->inodesPerDatablock] = inode;
+    }
+    writeBlockRun(fs, sb->inodeTableStart + firstBlock + done, blocks, chunk);
+  }
+  freeHeld(&chunk);
+}
+
+//the inode table is written only as far as it is used - when an inode after the high water mark
+//is allocated, the blocks of the table up to the one which holds it are filled with empty inodes
+static void extendInodeTable(FileSystem* fs, uint32_t inode) {
+  Superblock* sb = &fs->sb;
+  if (inode < sb->inodesHighWater)
+    return;
+  uint32_t firstBlock = sb->inodesHighWater / sb->inodesPerDatablock;
+  uint32_t lastBlock = inode / sb->inodesPerDatablock;
+  writeInodes(fs, firstBlock, lastBlock - firstBlock + 1);
+  sb->inodesHighWater = (lastBlock + 1) * sb->inodesPerDatablock;
+  if (sb->inodesHighWater > sb->inodeCount)
+    sb->inodesHighWater = sb->inodeCount;
+  markSuperblockDirty(fs);
+}
+
+//takes the first free inode and writes it as a new empty file or directory
+static int allocateInode(FileSystem* fs, char type) {
+  loadBitmaps(fs);
+  Bitmap* bm = &fs->inodeBitmap;
+  int64_t inode = findFreeBit(bm, bm->hint);
+  if (inode == -1) {
+    fail(11, "No more free inodes");
+  }
+  setBits(fs, bm, inode, 1, true);
+  bm->hint = inode + 1;
+  fs->sb.usedInodes++;
+  extendInodeTable(fs, inode);
+  markSuperblockDirty(fs);
+  
+  Inode in;
+  memset(&in, 0, sizeof(in));
+  in.type = type;
+  in.id = inode;
+  in.permissions = 644;
+  in.mod_time = time(NULL);
+  for (int i = 0; i < inodeExtents; i++) {
+    in.extents[i].start = -1;
+    in.extents[i].length = 0;
+  }
+  in.indirect = -1;
+  updateInode(fs, &in);
+  return inode;
+}
+
+//collects neighbouring blocks and writes them with one write - the small files of an import and
+//the new blocks of a file written with dedup get their datablocks one after another, so many of
+//them go out together
+typedef struct {
+  int64_t first;
+  uint32_t count;
+  char* buffer;
+  //the entry whose data is being added and the first one with data in the buffer
+  uint32_t entry;
+  uint32_t firstEntry;
+} RunWriter;
+
+static void flushRun(FileSystem* fs, RunWriter* run) {
+  if (run->count > 0)
+    writeBlockRun(fs, run->first, run->count, run->buffer);
+  run->count = 0;
+}
+
+static void addToRun(FileSystem* fs, RunWriter* run, int64_t first, uint32_t count, char* data) {
+  while (count > 0) {
+    if (run->count > 0 && (first != run->first + run->count || run->count == copyChunkBlocks(fs)))
+      flushRun(fs, run);
+    if (run->count == 0) {
+      run->first = first;
+      run->firstEntry = run->entry;
+    }
+    uint32_t part = count < copyChunkBlocks(fs) - run->count ? count : copyChunkBlocks(fs) - run->count;
+    memcpy(run->buffer + (size_t)run->count * fs->blockSize, data, (size_t)part * fs->blockSize);
+    run->count += part;
+    first += part;
+    data += (size_t)part * fs->blockSize;
+    count -= part;
+  }
+}
+
+static bool dedupEnabled(FileSystem* fs) {
+  return fs->sb.dedupStart != 0;
+}
+
+//BDSM_DEDUP=on makes mkfs reserve the dedup area, after that the files written by cpfile and import
+//share their blocks with the ones already in the image whatever it is set to
+static bool dedupRequested(void) {
+  char* mode = getenv("BDSM_DEDUP");
+  if (mode == NULL || strcmp(mode, "off") == 0)
+    return false;
+  if (strcmp(mode, "on") != 0)
+    fail(1, "BDSM_DEDUP must be either on or off");
+  return true;
+}
+
+static uint32_t referenceBlocks(FileSystem* fs, uint32_t dataBlocks) {
+  return dataBlocks / dedupWordsPerBlock(fs) + (dataBlocks % dedupWordsPerBlock(fs) == 0 ? 0 : 1);
+}
+
+//a word of the dedup area, which goes through the cache and the journal as all metadata
+static uint32_t* dedupWord(FileSystem* fs, uint64_t word, bool forWrite) {
+  int64_t block = fs->sb.dedupStart + word / dedupWordsPerBlock(fs);
+  char* data = forWrite ? getBlockForWrite(fs, block) : getBlock(fs, block);
+  return (uint32_t*)data + word % dedupWordsPerBlock(fs);
+}
+
+//0 for the datablocks which are not tracked - they were not written with dedup and are never shared
+static uint32_t referenceCount(FileSystem* fs, int32_t db) {
+  return *dedupWord(fs, db, false);
+}
+
+static void setReferenceCount(FileSystem* fs, int32_t db, uint32_t count) {
+  *dedupWord(fs, db, true) = count;
+}
+
+//a slot of the index holds a tracked datablock + 1 or 0 if it is free. The index is a hash table with
+//linear probing keyed by the checksums of the blocks, so the checksum area serves as the hashes
+static uint32_t* indexSlot(FileSystem* fs, uint32_t slot, bool forWrite) {
+  return dedupWord(fs, (uint64_t)referenceBlocks(fs, fs->sb.dataBlocks) * dedupWordsPerBlock(fs) + slot, forWrite);
+}
+
+//where the search for a block with the checksum starts, dedupSlots is a power of two
+static uint32_t homeSlot(FileSystem* fs, uint32_t checksum) {
+  return checksum & (fs->sb.dedupSlots - 1);
+}
+
+static uint32_t storedChecksum(FileSystem* fs, int32_t db) {
+  return *checksumEntry(fs, datablockPosition(fs, db));
+}
+
+//the tracked datablock with the same contents as block, -1 if there is none. The blocks with the
+//same checksum are compared byte by byte, the ones not written yet with the buffer of the run
+static int32_t findDuplicate(FileSystem* fs, char* block, uint32_t checksum, RunWriter* run) {
+  char stored[fs->blockSize];
+  uint32_t slot = homeSlot(fs, checksum);
+  for (uint32_t probes = 0; probes < fs->sb.dedupSlots; probes++) {
+    uint32_t entry = *indexSlot(fs, slot, false);
+    if (entry == 0)
+      return -1;
+    int32_t db = entry - 1;
+    int64_t position = datablockPosition(fs, db);
+    if (storedChecksum(fs, db) == checksum) {
+      char* contents = stored;
+      if (run->count > 0 && position >= run->first && position < run->first + run->count)
+        contents = run->buffer + (size_t)(position - run->first) * fs->blockSize;
+      else
+        readBlockRun(fs, position, 1, stored);
+      if (memcmp(contents, block, fs->blockSize) == 0)
+        return db;
+    }
+    slot = (slot + 1) & (fs->sb.dedupSlots - 1);
+  }
+  return -1;
+}
+
+//gives a new datablock its first reference and puts it in the index. Its checksum is set already,
+//because the index finds it by the checksum before its run is written. The index has at least twice
+//as many slots as there are datablocks, so there is always a free one
+static void trackBlock(FileSystem* fs, int32_t db, uint32_t checksum) {
+  setChecksum(fs, datablockPosition(fs, db), checksum);
+  uint32_t slot = homeSlot(fs, checksum);
+  while (*indexSlot(fs, slot, false) != 0) {
+    slot = (slot + 1) & (fs->sb.dedupSlots - 1);
+  }
+  *indexSlot(fs, slot, true) = db + 1;
+  setReferenceCount(fs, db, 1);
+  fs->sb.dedupBlocks++;
+  markSuperblockDirty(fs);
+}
+
+//takes the datablock out of the index. The entries after it which can't be found any more from their
+//home slot are moved back into the freed slot, so no search stops early at it
+static void untrackBlock(FileSystem* fs, int32_t db) {
+  uint32_t mask = fs->sb.dedupSlots - 1;
+  uint32_t hole = homeSlot(fs, storedChecksum(fs, db));
+  for (uint32_t probes = 0; *indexSlot(fs, hole, false) != (uint32_t)db + 1; probes++) {
+    if (*indexSlot(fs, hole, false) == 0 || probes == fs->sb.dedupSlots)
+      fail(10, "The file system is corrupted");
+    hole = (hole + 1) & mask;
+  }
+  for (uint32_t next = (hole + 1) & mask; ; next = (next + 1) & mask) {
+    uint32_t entry = *indexSlot(fs, next, false);
+    if (entry == 0)
+      break;
+    //the entry stays unless its home slot is at the hole or before it
+    uint32_t home = homeSlot(fs, storedChecksum(fs, entry - 1));
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      *indexSlot(fs, hole, true) = entry;
+      hole = next;
+    }
+  }
+  *indexSlot(fs, hole, true) = 0;
+  setReferenceCount(fs, db, 0);
+  fs->sb.dedupBlocks--;
+  markSuperblockDirty(fs);
+}
+
+//drops one reference of the datablock, true if other files still use it. After the last one the
+//block is freed as any other and its checksum is forgotten, because a copy which failed may have
+//tracked it without writing it
+static bool keepShared(FileSystem* fs, int32_t db) {
+  uint32_t count = referenceCount(fs, db);
+  if (count > 1) {
+    setReferenceCount(fs, db, count - 1);
+    fs->sb.dedupSaved--;
+    return true;
+  }
+  if (count == 1) {
+    untrackBlock(fs, db);
+    setChecksum(fs, datablockPosition(fs, db), 0);
+  }
+  return false;
+}
+
+//takes up to wanted neighbouring datablocks, so that a file gets as few extents as possible.
+//The first free run which is long enough is used and if there is no such run - the longest one.
+//Returns the first of the datablocks and sets length to how many were taken
+static int allocateRun(FileSystem* fs, uint32_t wanted, uint32_t* length) {
+  loadBitmaps(fs);
+  Bitmap* bm = &fs->blockBitmap;
+  int64_t bit = findFreeBit(bm, bm->hint);
+  if (bit == -1) {
+    fail(28, "No more free datablocks");
+  }
+  bm->hint = bit;
+  int64_t best = bit;
+  uint32_t bestLength = 0;
+  while (bit != -1) {
+    uint32_t run = freeRunLength(bm, bit, wanted);
+    if (run > bestLength) {
+      best = bit;
+      bestLength = run;
+    }
+    if (run == wanted)
+      break;
+    bit = findFreeBit(bm, bit + run);
+  }
+  setBits(fs, bm, best, bestLength, true);
+  fs->sb.usedDataBlocks += bestLength;
+  //the checksums of the datablocks which were never used may be left from an older file system
+  for (uint32_t db = fs->sb.datablocksHighWater; db < best + bestLength; db++) {
+    setChecksum(fs, datablockPosition(fs, db), 0);
+  }
+  if (best + bestLength > fs->sb.datablocksHighWater)
+    fs->sb.datablocksHighWater = best + bestLength;
+  markSuperblockDirty(fs);
+  *length = bestLength;
+  return best;
+}
+
+static int allocateDatablock(FileSystem* fs) {
+  uint32_t length;
+  return allocateRun(fs, 1, &length);
+}
+
+//clears the bits of the datablocks the call freed
+static void releaseFreed(FileSystem* fs) {
+  UndoLog* u = &fs->undo;
+  for (uint32_t i = 0; i < u->freedCount; i++) {
+    setBits(fs, &fs->blockBitmap, u->freed[i].start, u->freed[i].length, false);
+    fs->sb.usedDataBlocks -= u->freed[i].length;
+    markSuperblockDirty(fs);
+  }
+  u->freedCount = 0;
+}
+
+//the blocks stay used until the call ends, so they count as used for the checks of the free space too
+static void freeDatablocks(FileSystem* fs, uint32_t first, uint32_t count) {
+  UndoLog* u = &fs->undo;
+  if (!recordingChanges(fs)) {
+    setBits(fs, &fs->blockBitmap, first, count, false);
+    fs->sb.usedDataBlocks -= count;
+    return;
+  }
+  if (u->freedCount > 0 && u->freed[u->freedCount - 1].start + u->freed[u->freedCount - 1].length == first) {
+    u->freed[u->freedCount - 1].length += count;
+    return;
+  }
+  if (u->freedCount == u->freedCapacity) {
+    uint32_t capacity = u->freedCapacity * 2 + 16;
+    Extent* freed = realloc(u->freed, capacity * sizeof(Extent));
+    if (freed == NULL)
+      failErrno(23, "Error allocating memory for the undo log");
+    u->freed = freed;
+    u->freedCapacity = capacity;
+  }
+  u->freed[u->freedCount++] = (Extent){first, count};
+}
+
+static void deleteDatablocks(FileSystem* fs, int first, uint32_t count) {
+  loadBitmaps(fs);
+  if (dedupEnabled(fs)) {
+    //only the blocks which no other file uses are freed
+    for (uint32_t i = 0; i < count; i++) {
+      if (!keepShared(fs, first + i))
+        freeDatablocks(fs, first + i, 1);
+    }
+  } else {
+    freeDatablocks(fs, first, count);
+  }
+  markSuperblockDirty(fs);
+}
+
+static void deleteDb(FileSystem* fs, int num) {
+  deleteDatablocks(fs, num, 1);
+}
+
+static void deleteInode(FileSystem* fs, int num) {
+  loadBitmaps(fs);
+  setBits(fs, &fs->inodeBitmap, num, 1, false);
+  fs->sb.usedInodes--;
+  markSuperblockDirty(fs);
+}
+
+//returns all extents of the inode in a new array - the ones from the inode first and then the ones from the extent blocks
+static Extent* loadExtents(FileSystem* fs, Inode* in, int* count) {
+  Extent* extents = malloc(inodeExtents * sizeof(Extent));
+  if (extents == NULL)
+    failErrno(23, "Error allocating memory for the extents");
+  holdMemory(&extents);
+  *count = 0;
+  for (int i = 0; i < inodeExtents && in->extents[i].length != 0; i++) {
+    extents[(*count)++] = in->extents[i];
+  }
+  int32_t current = in->indirect;
+  while (current != -1) {
+    ExtentBlock* block = (ExtentBlock*)locateDatablock(fs, current, false);
+    Extent* grown = realloc(extents, (*count + block->count > 0 ? *count + block->count : 1) * sizeof(Extent));
+    if (grown == NULL)
+      failErrno(23, "Error allocating memory for the extents");
+    extents = grown;
+    memcpy(extents + *count, block->extents, block->count * sizeof(Extent));
+    *count += block->count;
+    current = block->next;
+  }
+  letGo(&extents);
+  return extents;
+}
+
+//puts the extents back - the first inodeExtents in the inode and the rest in the chain of extent
+//blocks, which gets longer or shorter as needed. The inode itself is written by the caller
+static void storeExtents(FileSystem* fs, Inode* in, Extent* extents, int count) {
+  for (int i = 0; i < inodeExtents; i++) {
+    if (i < count) {
+      in->extents[i] = extents[i];
+    } else {
+      in->extents[i].start = -1;
+      in->extents[i].length = 0;
+    }
+  }
+
+  int stored = count < inodeExtents ? count : inodeExtents;
+  int perBlock = extentsPerBlock(fs);
+  int32_t previous = -1;
+  int32_t current = in->indirect;
+  while (stored < count) {
+    if (current == -1) {
+      current = allocateDatablock(fs);
+      ((ExtentBlock*)locateDatablock(fs, current, true))->next = -1;
+      if (previous == -1)
+        in->indirect = current;
+      else
+        ((ExtentBlock*)locateDatablock(fs, previous, true))->next = current;
+    }
+    uint32_t blockCount = count - stored < perBlock ? count - stored : perBlock;
+    ExtentBlock* block = (ExtentBlock*)locateDatablock(fs, current, false);
+    //only the extent blocks which change go in the transaction, usually the last one
+    if (block->count != blockCount || memcmp(block->extents, extents + stored, blockCount * sizeof(Extent)) != 0) {
+      block = (ExtentBlock*)locateDatablock(fs, current, true);
+      block->count = blockCount;
+      memcpy(block->extents, extents + stored, blockCount * sizeof(Extent));
+    }
+    stored += blockCount;
+    previous = current;
+    current = block->next;
+  }
+
+  //the extent blocks after the last used one are not needed anymore
+  if (previous == -1)
+    in->indirect = -1;
+  else if (current != -1)
+    ((ExtentBlock*)locateDatablock(fs, previous, true))->next = -1;
+  while (current != -1) {
+    int32_t next = ((ExtentBlock*)locateDatablock(fs, current, false))->next;
+    deleteDb(fs, current);
+    current = next;
+  }
+}
+
+//adds a run of datablocks at the end of the list, merging it with the last extent if they are neighbours
+static void appendExtent(Extent** extents, int* count, int32_t start, uint32_t length) {
+  if (*count > 0 && (*extents)[*count - 1].start + (int32_t)(*extents)[*count - 1].length == start) {
+    (*extents)[*count - 1].length += length;
+    return;
+  }
+  Extent* grown = realloc(*extents, (*count + 1) * sizeof(Extent));
+  if (grown == NULL)
+    failErrno(23, "Error allocating memory for the extents");
+  *extents = grown;
+  (*extents)[*count].start = start;
+  (*extents)[*count].length = length;
+  (*count)++;
+}
+
+//the datablock which holds the index-th block of a file or directory
+static int32_t extentBlock(Extent* extents, int count, uint32_t index) {
+  for (int i = 0; i < count; i++) {
+    if (index < extents[i].length)
+      return extents[i].start + index;
+    index -= extents[i].length;
+  }
+  return -1;
+}
+
+//the datablock with the given index in the file and how many blocks follow it in the same extent
+static int32_t extentRun(Extent* extents, int count, uint32_t index, uint32_t* left) {
+  for (int i = 0; i < count; i++) {
+    if (index < extents[i].length) {
+      *left = extents[i].length - index;
+      return extents[i].start + index;
+    }
+    index -= extents[i].length;
+  }
+  fail(10, "The file system is corrupted");
+}
+
+static bool isInline(Inode* in) {
+  return in->reserved & inodeFlagInline;
+}
+
+//keeps the data of an object without datablocks in the inode, an empty object is not inline
+static void storeInline(Inode* in, void* data, uint32_t size) {
+  memset(in->inlineData, 0, inlineDataSize);
+  in->reserved &= ~inodeFlagInline;
+  if (size == 0)
+    return;
+  memcpy(in->inlineData, data, size);
+  in->reserved |= inodeFlagInline;
+}
+
+//frees all datablocks of the inode together with its extent blocks and drops its inline data,
+//so it can be filled again as a plain file
+static void freeFileBlocks(FileSystem* fs, Inode* in) {
+  int count;
+  Extent* extents = loadExtents(fs, in, &count);
+  holdMemory(&extents);
+  for (int i = 0; i < count; i++) {
+    deleteDatablocks(fs, extents[i].start, extents[i].length);
+  }
+  storeExtents(fs, in, NULL, 0);
+  storeInline(in, NULL, 0);
+  in->reserved &= ~(inodeFlagCompressed | inodeFlagDeduped);
+  freeHeld(&extents);
+}
+
+//moves the inline data to the first datablock of the object when it grows past inlineDataSize.
+//The rows of a directory go through the cache as all metadata, the data of a file is written directly
+static void promoteInline(FileSystem* fs, Inode* in) {
+  char block[fs->blockSize];
+  memset(block, 0, fs->blockSize);
+  memcpy(block, in->inlineData, inlineDataSize);
+  Extent extent;
+  extent.start = allocateDatablock(fs);
+  extent.length = 1;
+  if (in->type == 'd')
+    memcpy(locateDatablock(fs, extent.start, true), block, fs->blockSize);
+  else
+    writeBlockRun(fs, datablockPosition(fs, extent.start), 1, block);
+  storeExtents(fs, in, &extent, 1);
+  storeInline(in, NULL, 0);
+}
+
+//a new bitmap with all bits free, every block of it is written by syncFS
+static void createBitmap(FileSystem* fs, Bitmap* bm, uint32_t start, uint32_t bits) {
+  initBitmap(fs, bm, start, bitmapBlocks(fs, bits), bits);
+  setBitmapPadding(bm);
+  memset(bm->dirty, true, bm->blocks * sizeof(bool));
+  bm->dirtyCount = bm->blocks;
+}
+
+static void mkfs(FileSystem* fs) {
+  uint64_t size = getSize(fs);
+  //fsSize and the positions in the image are 32-bit
+  if (size > UINT32_MAX)
+    fail(36, "The image is bigger than 4 GiB, the most a file system can use");
+  Superblock superblock;
+  //one inode for every 2000 bytes of the image
+  uint32_t inodeCount = size > sizeof(superblock) ? (size - sizeof(superblock)) / 2000 : 0;
+
+  superblock.fsType = fsVersion; 
+  superblock.fsSize = size;
+  superblock.inodeCount = inodeCount;
+  superblock.usedInodes = 0;
+  superblock.usedDataBlocks = 0;
+  superblock.inodesHighWater = 0;
+  superblock.datablocksHighWater = 0;
+  superblock.inodesPerDatablock = fs->blockSize / sizeof(Inode);
+  superblock.blockSize = fs->blockSize;
+ 
+  //1 block for the superblock, then the journal, the inode bitmap, the datablock bitmap, the checksums
+  //and the inodes. The datablock bitmap needs one bit for each of the blocks left after it and to keep
+  //it simple the checksum area has a place for every block of the image
+  //a command is one transaction, so half of the journal has room for the checksums and the bitmaps of
+  //the whole image, as a copy of a file as big as the image changes them
+  uint64_t imageBlocks = (uint64_t)size / fs->blockSize;
+  uint64_t metadataBytes = imageBlocks * sizeof(uint32_t) + imageBlocks / 4;
+  //with dedup a copy can also change a reference count for every block and the whole index, which
+  //has up to four words for every block
+  if (dedupRequested())
+    metadataBytes += imageBlocks * 5 * sizeof(uint32_t);
+  uint64_t leastBytes = 2 * metadataBytes + minJournalBytes;
+  uint64_t mostBytes = leastBytes > maxJournalBytes ? leastBytes : maxJournalBytes;
+  uint64_t journalBytes = size / 32;
+  journalBytes = journalBytes < leastBytes ? leastBytes : journalBytes;
+  journalBytes = journalBytes > mostBytes ? mostBytes : journalBytes;
+  uint32_t journalBlocks = journalBytes / fs->blockSize;
+  journalBlocks = journalBlocks < minJournalBlocks ? minJournalBlocks : journalBlocks;
+  superblock.journalStart = 1;
+  superblock.journalBlocks = journalBlocks & ~1u;
+  superblock.inodeBitmapStart = superblock.journalStart + superblock.journalBlocks;
+  superblock.blockBitmapStart = superblock.inodeBitmapStart + bitmapBlocks(fs, inodeCount);
+  uint32_t checksumBlocks = size / fs->blockSize / checksumsPerBlock(fs) + 1;
+  int64_t blocksLeft = (int64_t)(size / fs->blockSize) - superblock.blockBitmapStart - checksumBlocks - datablocksForInodes(&superblock);
+  //with dedup the inodes are followed by a reference count for every datablock and an index with at
+  //least twice as many slots, both counted for all blocks left to keep it simple
+  uint32_t dedupAreaBlocks = 0;
+  superblock.dedupSlots = 0;
+  if (dedupRequested() && blocksLeft > 0) {
+    superblock.dedupSlots = dedupWordsPerBlock(fs);
+    while (superblock.dedupSlots < 2 * blocksLeft)
+      superblock.dedupSlots *= 2;
+    dedupAreaBlocks = referenceBlocks(fs, blocksLeft) + superblock.dedupSlots / dedupWordsPerBlock(fs);
+    blocksLeft -= dedupAreaBlocks;
+  }
+  int64_t dataBlocks = blocksLeft - (blocksLeft > 0 ? bitmapBlocks(fs, blocksLeft) : 0);
+  if (dataBlocks <= 0)
+    fail(28, "No more free datablocks");
+  superblock.dataBlocks = dataBlocks;
+  superblock.checksumStart = superblock.blockBitmapStart + bitmapBlocks(fs, dataBlocks);
+  superblock.inodeTableStart = superblock.checksumStart + checksumBlocks;
+  superblock.dedupStart = dedupAreaBlocks > 0 ? superblock.inodeTableStart + datablocksForInodes(&superblock) : 0;
+  superblock.dedupBlocks = 0;
+  superblock.dedupSaved = 0;
+  superblock.firstDatablock = superblock.inodeTableStart + datablocksForInodes(&superblock) + dedupAreaBlocks;
+  fs->sb = superblock;
+  markSuperblockDirty(fs);
+  initChecksums(fs);
+  //the transactions left from an older file system in the same place must not be replayed
+  char empty[fs->blockSize];
+  memset(empty, 0, sizeof(empty));
+  writeBlockRun(fs, superblock.journalStart, 1, empty);
+  writeBlockRun(fs, superblock.journalStart + superblock.journalBlocks / 2, 1, empty);
+  //and neither must the reference counts and the index
+  char* zeroes = allocBlocks(fs, copyChunkBlocks(fs));
+  if (zeroes == NULL)
+    failErrno(23, "Error allocating memory for the dedup area");
+  holdMemory(&zeroes);
+  memset(zeroes, 0, copyChunkBytes);
+  for (uint32_t done = 0; done < dedupAreaBlocks; done += copyChunkBlocks(fs)) {
+    uint32_t count = dedupAreaBlocks - done < copyChunkBlocks(fs) ? dedupAreaBlocks - done : copyChunkBlocks(fs);
+    writeBlockRun(fs, superblock.dedupStart + done, count, zeroes);
+  }
+  freeHeld(&zeroes);
+  setupJournal(fs);
+ 
+  createBitmap(fs, &fs->inodeBitmap, superblock.inodeBitmapStart, superblock.inodeCount);
+  createBitmap(fs, &fs->blockBitmap, superblock.blockBitmapStart, superblock.dataBlocks);
+  fs->bitmapsLoaded = true;
+
+  //only the bitmaps, the superblock and the block of the inode table with the root are written,
+  //the rest of the inode table is written when it is needed (extendInodeTable)
+  //allocating the inode for the root directory
+  allocateInode(fs, 'd');
+}
+
+static bool validatePath(char path[]) {
+  if (strlen(path) <= 2 || path[0] != '+' || path[1] != '/' )
+    return false;
+
+  for(size_t i = 2; i < strlen(path); i++) {
+    if (path[i] == '/' && path[i - 1] == '/')
+      return false;
+    else if (path[i] != '/' && path[i] != '_' && path[i] != '.' &&
+             !(path[i] >= 'a' && path[i] <= 'z') && 
+             !(path[i] >= 'A' && path[i] <= 'Z') &&
+             !(path[i] >= '0' && path[i] <= '9'))
+      return false;
+  }
+  
+  return path[strlen(path) - 1] != '/';
+}
+
+static int32_t findDirIfExistant(FileSystem* fs, int db, int dirRowsCount, char name[]) {
+  DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, db, false);
+  for (int i = 0; i < dirRowsCount; i++) {
+    if (strcmp(rows[i].name, name) == 0) {
+      return rows[i].inodeNum;
+    }  
+  }
+  return -1;
+}
+
+//FNV-1a, decides in which bucket of a hashed directory the name goes
+static uint32_t nameHash(char name[]) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; name[i] != '\0'; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t extentsLength(Extent* extents, int count) {
+  uint32_t length = 0;
+  for (int i = 0; i < count; i++) {
+    length += extents[i].length;
+  }
+  return length;
+}
+
+//the next blocks of the extents, from block done of extent *index, as runs of the image of at most
+//limit blocks together. index and done are moved after them and blocks gets how many there are
+static int nextRuns(FileSystem* fs, Extent* extents, int count, int* index, uint32_t* done, uint32_t limit, BlockRun* runs, uint32_t* blocks) {
+  int runCount = 0;
+  *blocks = 0;
+  while (*index < count && *blocks < limit) {
+    Extent* extent = &extents[*index];
+    uint32_t part = extent->length - *done < limit - *blocks ? extent->length - *done : limit - *blocks;
+    runs[runCount].first = datablockPosition(fs, extent->start + *done);
+    runs[runCount++].count = part;
+    *blocks += part;
+    *done += part;
+    if (*done == extent->length) {
+      (*index)++;
+      *done = 0;
+    }
+  }
+  return runCount;
+}
+
+//the bucket of a hash in a hashed directory, one datablock each. The buckets grow by linear hashing, so
+//with low the biggest power of two not above their count, the buckets before count - low and the ones
+//from low on are already split by the bit low of the hash and the rest are not
+static uint32_t bucketIndex(uint32_t hash, uint32_t buckets) {
+  uint32_t low = 1u << (31 - __builtin_clz(buckets));
+  uint32_t bucket = hash & (2 * low - 1);
+  return bucket < buckets ? bucket : hash & (low - 1);
+}
+
+//the datablock with the bucket of the name
+static int32_t bucketBlock(Extent* extents, int count, char name[]) {
+  return extentBlock(extents, count, bucketIndex(nameHash(name), extentsLength(extents, count)));
+}
+
+static int32_t locateDir(FileSystem* fs, uint32_t inodeNum, char name[] ) {
+  Inode in;
+  readInode(fs, inodeNum, &in);
+  //the data of a regular file are not rows, so nothing is found in it
+  if (in.type != 'd')
+    return -1;
+  int rowsCount = in.size / sizeof(DirectoryRow);
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, &in, &extentCount);
+  holdMemory(&extents);
+  int32_t pos = -1;
+  if (in.reserved & inodeFlagHashed) {
+    //only the bucket of the name has to be checked, the empty rows in it have an empty name
+    pos = findDirIfExistant(fs, bucketBlock(extents, extentCount, name), rowsPerDb, name);
+    freeHeld(&extents);
+    return pos;
+  }
+  DirectoryRow* inlineRows = (DirectoryRow*)in.inlineData;
+  for (int i = 0; isInline(&in) && i < rowsCount && pos == -1; i++) {
+    if (strcmp(inlineRows[i].name, name) == 0)
+      pos = inlineRows[i].inodeNum;
+  }
+  int firstRow = 0;
+  for (int i = 0; i < extentCount && pos == -1; i++) {
+    for (uint32_t j = 0; j < extents[i].length && pos == -1 && firstRow < rowsCount; j++) {
+      int rows = rowsCount - firstRow < rowsPerDb ? rowsCount - firstRow : rowsPerDb;
+      pos = findDirIfExistant(fs, extents[i].start + j, rows, name);
+      firstRow += rowsPerDb;
+    }
+  }
+
+  freeHeld(&extents);
+  return pos;
+}
+
+//the entry in which the name from the given directory is cached, each name has only one possible entry
+static DentryCacheEntry* dentrySlot(FileSystem* fs, uint32_t parent, char name[]) {
+  return &fs->dentries[(nameHash(name) ^ parent * 2654435761u) & (dentryCacheSize - 1)];
+}
+
+//remembers that the name in the directory parent is the inode child (-1 for a missing name)
+static void setDentry(FileSystem* fs, uint32_t parent, char name[], int32_t child) {
+  DentryCacheEntry* entry = dentrySlot(fs, parent, name);
+  if (strlen(name) >= sizeof(entry->name))
+    return;
+  entry->parent = parent;
+  entry->child = child;
+  strcpy(entry->name, name);
+}
+
+//locateDir through the dentry cache
+static int32_t lookupDir(FileSystem* fs, uint32_t parent, char name[]) {
+  DentryCacheEntry* entry = dentrySlot(fs, parent, name);
+  if (entry->parent == parent && strcmp(entry->name, name) == 0) {
+    fs->dentryHits++;
+    return entry->child;
+  }
+  fs->dentryMisses++;
+  int32_t child = locateDir(fs, parent, name);
+  setDentry(fs, parent, name, child);
+  return child;
+}
+
+static int32_t goToDirWithoutCheck(FileSystem* fs, char path[]) {
+  if (strcmp(path, "+/") == 0) {
+      return 0;
+  } else {
+    char* dirToGo = malloc(strlen(path));
+    if (dirToGo == NULL)
+      failErrno(23, "Error allocating memory for the path");
+    holdMemory(&dirToGo);
+    int position = 0;
+    int32_t parentDirInode = 0;
+    //<= because the '\0' ends the last name in the path
+    for (size_t i = 2; i <= strlen(path) && parentDirInode != -1; i++) {
+      if (path[i] != '/' && path[i] != '\0') {
+        dirToGo[position++] = path[i];
+        continue;
+      }
+      //a '/' at the end of the path (the parent path in addToDir) doesn't start a new name
+      if (position == 0)
+        continue;
+      dirToGo[position] = '\0';
+      parentDirInode = lookupDir(fs, parentDirInode, dirToGo);
+      position = 0;
+    }
+
+    freeHeld(&dirToGo); 
+    return parentDirInode; 
+  }
+}
+
+static uint32_t goToDir(FileSystem* fs, char path[]) {
+  int32_t dir = goToDirWithoutCheck(fs, path);
+  if (dir == -1)
+    fail(12, "Invalid path");
+  return dir;
+}
+
+//takes n datablocks filled with zeroes and adds them at the end of the extents
+static void allocateEmptyBlocks(FileSystem* fs, Extent** extents, int* count, uint32_t n) {
+  for (uint32_t allocated = 0; allocated < n; ) {
+    uint32_t length;
+    int32_t start = allocateRun(fs, n - allocated, &length);
+    for (uint32_t i = 0; i < length; i++) {
+      memset(getNewBlock(fs, datablockPosition(fs, start + i)), 0, fs->blockSize);
+    }
+    appendExtent(extents, count, start, length);
+    allocated += length;
+  } 
+}
+
+//adds one bucket to a hashed directory - with low the biggest power of two not above the buckets, the
+//rows of bucket buckets - low whose hash has the bit low set move to the new bucket. So a split touches
+//only two buckets, however big the directory is
+static void splitBucket(FileSystem* fs, Inode* in) {
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  uint32_t buckets = extentsLength(extents, extentCount);
+  if (buckets >= maxDirBuckets)
+    fail(14, "No more free space in the directory");
+  uint32_t low = 1u << (31 - __builtin_clz(buckets));
+  int32_t split = extentBlock(extents, extentCount, buckets - low);
+  allocateEmptyBlocks(fs, &extents, &extentCount, 1);
+  storeExtents(fs, in, extents, extentCount);
+  int32_t added = extentBlock(extents, extentCount, buckets);
+  freeHeld(&extents);
+
+  DirectoryRow moved[rowsPerDb];
+  int movedCount = 0;
+  DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, split, false);
+  for (int j = 0; j < rowsPerDb; j++) {
+    if (rows[j].name[0] != '\0' && (nameHash(rows[j].name) & low) != 0)
+      moved[movedCount++] = rows[j];
+  }
+  //the old bucket goes in the transaction only if some of its rows moved
+  if (movedCount == 0)
+    return;
+  rows = (DirectoryRow*)locateDatablock(fs, split, true);
+  for (int j = 0; j < rowsPerDb; j++) {
+    if (rows[j].name[0] != '\0' && (nameHash(rows[j].name) & low) != 0)
+      memset(&rows[j], 0, sizeof(DirectoryRow));
+  }
+  memcpy(locateDatablock(fs, added, true), moved, movedCount * sizeof(DirectoryRow));
+}
+
+//the place for the name in its bucket, or NULL if the bucket is full
+static DirectoryRow* freeHashedRow(FileSystem* fs, Inode* in, char name[], bool forWrite) {
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, bucketBlock(extents, extentCount, name), forWrite);
+  freeHeld(&extents);
+  for (int i = 0; i < rowsPerDb; i++) {
+    if (rows[i].name[0] == '\0')
+      return &rows[i];
+  }
+  return NULL;
+}
+
+//puts the row in the first empty place in its bucket, buckets are split while it is full
+static void insertHashedRow(FileSystem* fs, Inode* in, DirectoryRow* row) {
+  DirectoryRow* place;
+  while ((place = freeHashedRow(fs, in, row->name, true)) == NULL) {
+    splitBucket(fs, in);
+  }
+  *place = *row;
+}
+
+//gets the bucket of the name ready for one more row. One bucket is split when the rows fill more than
+//three quarters of the places, which keeps full buckets rare, and more only while the bucket of the name
+//is full. Every split leaves a whole directory, so when the journal fills, the splits so far are
+//committed before the next one and a directory of any size grows within the journal
+static void makeRoomInBucket(FileSystem* fs, Inode* in, char name[]) {
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  uint32_t buckets = extentsLength(extents, extentCount);
+  freeHeld(&extents);
+  uint64_t rows = in->size / sizeof(DirectoryRow) + 1;
+  if (rows * 4 > (uint64_t)buckets * rowsPerDb * 3 && buckets < maxDirBuckets) {
+    splitBucket(fs, in);
+    updateInode(fs, in);
+  }
+  while (freeHashedRow(fs, in, name, false) == NULL) {
+    makeJournalRoom(fs);
+    splitBucket(fs, in);
+    updateInode(fs, in);
+  }
+}
+
+//copies all rows of the directory in a new array, the empty rows of a hashed directory are skipped.
+//A directory of more than one block is read with the I/O engine, the runs of several extents together
+static DirectoryRow* readDirRows(FileSystem* fs, Inode* in, int* count) {
+  int rowsCount = in->size / sizeof(DirectoryRow);
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  DirectoryRow* rows = malloc((rowsCount + 1) * sizeof(DirectoryRow));
+  if (rows == NULL)
+    failErrno(23, "Error allocating memory for reading the directory");
+  holdMemory(&rows);
+  *count = 0;
+  if (extentsLength(extents, extentCount) <= 1) {
+    for (int i = 0; i < extentCount && *count < rowsCount; i++) {
+      for (uint32_t j = 0; j < extents[i].length && *count < rowsCount; j++) {
+        DirectoryRow* block = (DirectoryRow*)locateDatablock(fs, extents[i].start + j, false);
+        //the rows of a linear directory are one after another, so it ends before the unused rows
+        for (int k = 0; k < rowsPerDb && *count < rowsCount; k++) {
+          if (block[k].name[0] != '\0')
+            rows[(*count)++] = block[k];
+        }
+      }
+    }
+  } else {
+    uint32_t bufferBlocks = batchBlocks(fs);
+    char* buffer = allocBlocks(fs, bufferBlocks);
+    holdMemory(&buffer);
+    BlockRun* runs = malloc(extentCount * sizeof(BlockRun));
+    holdMemory(&runs);
+    if (buffer == NULL || runs == NULL)
+      failErrno(23, "Error allocating memory for reading the directory");
+    int index = 0;
+    uint32_t done = 0;
+    while (index < extentCount && *count < rowsCount) {
+      uint32_t blocks;
+      int runCount = nextRuns(fs, extents, extentCount, &index, &done, bufferBlocks, runs, &blocks);
+      readBlockRuns(fs, &fs->io, runs, runCount, buffer);
+      char* data = buffer;
+      for (int i = 0; i < runCount; i++) {
+        verifyBlockRun(fs, runs[i].first, runs[i].count, data);
+        data += (size_t)runs[i].count * fs->blockSize;
+      }
+      for (uint32_t j = 0; j < blocks * rowsPerDb && *count < rowsCount; j++) {
+        DirectoryRow* row = (DirectoryRow*)(buffer + (size_t)(j / rowsPerDb) * fs->blockSize) + j % rowsPerDb;
+        if (row->name[0] != '\0')
+          rows[(*count)++] = *row;
+      }
+    }
+    freeHeld(&runs);
+    freeHeld(&buffer);
+  }
+  if (isInline(in)) {
+    memcpy(rows, in->inlineData, (size_t)rowsCount * sizeof(DirectoryRow));
+    *count = rowsCount;
+  }
+  freeHeld(&extents);
+  letGo(&rows);
+  return rows;
+}
+
+//a linear directory which needs a second datablock is turned into a hashed one with
+//enough buckets for the rows to take up at most half of the places
+static void convertToHashed(FileSystem* fs, Inode* in) {
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int rowsCount;
+  DirectoryRow* rows = readDirRows(fs, in, &rowsCount);
+  holdMemory(&rows);
+  freeFileBlocks(fs, in);
+  uint32_t buckets = 2;
+  while (buckets * rowsPerDb < 2 * (uint32_t)(rowsCount + 1)) {
+    buckets *= 2;
+  }
+  int extentCount = 0;
+  Extent* extents = NULL;
+  holdMemory(&extents);
+  allocateEmptyBlocks(fs, &extents, &extentCount, buckets);
+  storeExtents(fs, in, extents, extentCount);
+  freeHeld(&extents);
+  in->reserved |= inodeFlagHashed;
+  for (int i = 0; i < rowsCount; i++) {
+    insertHashedRow(fs, in, &rows[i]);
+  }
+  freeHeld(&rows);
+}
+
+//adds a new object with the name to the directory with the inode parent
+static uint32_t addToParent(FileSystem* fs, uint32_t parent, char toBeAdded[], char type) {
+  Inode in;
+  readInode(fs, parent, &in);
+  if (in.type != 'd')
+    fail(33, "Not a directory");
+  
+  if (lookupDir(fs, in.id, toBeAdded) != -1) {
+    fail(9, "Directory already exists");
+  }
+
+  DirectoryRow dirRow;
+  //the name has to leave place for the terminating zero character
+  if (strlen(toBeAdded) >= sizeof(dirRow.name)) {
+    fail(13, "The name is too long");
+  }
+  memset(&dirRow, 0, sizeof(dirRow));
+  strcpy(dirRow.name, toBeAdded);
+  if (in.reserved & inodeFlagHashed)
+    makeRoomInBucket(fs, &in, toBeAdded);
+  dirRow.inodeNum = allocateInode(fs, type);
+
+  if (!(in.reserved & inodeFlagHashed) && in.size != 0 && in.size % fs->blockSize == 0)
+    convertToHashed(fs, &in);
+
+  if (in.reserved & inodeFlagHashed) {
+    insertHashedRow(fs, &in, &dirRow);
+  } else if (in.size + sizeof(dirRow) <= inlineDataSize) {
+    //the first rows of a directory are kept in the inode
+    memcpy(in.inlineData + in.size, &dirRow, sizeof(dirRow));
+    in.reserved |= inodeFlagInline;
+  } else {
+    if (isInline(&in))
+      promoteInline(fs, &in);
+    int extentCount;
+    Extent* extents = loadExtents(fs, &in, &extentCount);
+    holdMemory(&extents);
+    int32_t dbForNewData = extentBlock(extents, extentCount, in.size / fs->blockSize);
+    freeHeld(&extents);
+    DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, dbForNewData, true);
+    rows[(in.size % fs->blockSize) / sizeof(dirRow)] = dirRow;
+  }
+  in.size += sizeof(dirRow);
+  updateInode(fs, &in);
+  setDentry(fs, in.id, toBeAdded, dirRow.inodeNum);
+  return dirRow.inodeNum;
+}
+
+static uint32_t addToDir(FileSystem* fs, char path[], char toBeAdded[], char type) {
+  int size = strlen(path) - strlen(toBeAdded) + 1;
+  char* goTo = malloc(size);
+  if (goTo == NULL)
+    failErrno(23, "Error allocating memory for the path");
+  holdMemory(&goTo);
+  strncpy(goTo, path, size - 1);
+  goTo[size - 1] = '\0';
+  int inode = goToDir(fs, goTo);
+  freeHeld(&goTo);
+  return addToParent(fs, inode, toBeAdded, type);
+}
+
+//removes the row with the given name, in a linear directory the last row takes its place
+static void removeFromDir(FileSystem* fs, Inode* in, char name[]) {
+  int rowsPerDb = fs->blockSize / sizeof(DirectoryRow);
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  if (in->reserved & inodeFlagHashed) {
+    DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, bucketBlock(extents, extentCount, name), true);
+    int i = 0;
+    while (i < rowsPerDb && strcmp(rows[i].name, name) != 0) {
+      i++;
+    }
+    if (i == rowsPerDb)
+      fail(22, "Error during deletion");
+    memset(&rows[i], 0, sizeof(DirectoryRow));
+    in->size -= sizeof(DirectoryRow);
+    freeHeld(&extents);
+    return;
+  }
+  if (isInline(in)) {
+    DirectoryRow* rows = (DirectoryRow*)in->inlineData;
+    int rowsCount = in->size / sizeof(DirectoryRow);
+    int i = 0;
+    while (i < rowsCount && strcmp(rows[i].name, name) != 0) {
+      i++;
+    }
+    if (i == rowsCount)
+      fail(22, "Error during deletion");
+    rows[i] = rows[rowsCount - 1];
+    memset(&rows[rowsCount - 1], 0, sizeof(DirectoryRow));
+    in->size -= sizeof(DirectoryRow);
+    if (in->size == 0)
+      in->reserved &= ~inodeFlagInline;
+    freeHeld(&extents);
+    return;
+  }
+
+  int32_t rowsCount = in->size / sizeof(DirectoryRow);
+  //the position of the row is counted from the start of the directory
+  int32_t posInDir = -1;
+  for (int i = 0; i * rowsPerDb < rowsCount && posInDir == -1; i++) {
+    int db = extentBlock(extents, extentCount, i);
+    if (db == -1)
+      fail(22, "Error during deletion");
+    DirectoryRow* rows = (DirectoryRow*)locateDatablock(fs, db, false);
+    for (int j = 0; j < rowsPerDb && i * rowsPerDb + j < rowsCount; j++) {
+      if (strcmp(rows[j].name, name) == 0) {
+        posInDir = i * rowsPerDb + j;
+      }
+    }
+  }
+  if (posInDir == -1)
+    fail(22, "Error during deletion");
+
+  int32_t lastDb = extentBlock(extents, extentCount, (rowsCount - 1) / rowsPerDb);
+  DirectoryRow last = ((DirectoryRow*)locateDatablock(fs, lastDb, false))[(rowsCount - 1) % rowsPerDb];
+  int32_t posDb = extentBlock(extents, extentCount, posInDir / rowsPerDb);
+  ((DirectoryRow*)locateDatablock(fs, posDb, true))[posInDir % rowsPerDb] = last;
+  in->size -= sizeof(DirectoryRow);
+  if (in->size % fs->blockSize == 0) {
+    //the last datablock of the directory is empty now
+    Extent* lastExtent = &extents[extentCount - 1];
+    deleteDb(fs, lastExtent->start + lastExtent->length - 1);
+    if (--lastExtent->length == 0)
+      extentCount--;
+    storeExtents(fs, in, extents, extentCount);
+  }
+  freeHeld(&extents);
+}
+
+//mkdir is a function in stat.h so I had to use a different name
+static void fsmkdir(FileSystem* fs, char path[]) {
+  if (!validatePath(path)) {
+    fail(12, "Invalid path in mkdir");
+  }
+  
+  int nameSize = 32;
+  char* name = malloc(nameSize);
+  if (name == NULL)
+    failErrno(23, "Error allocating memory for the name");
+  holdMemory(&name);
+  int position = 0;
+
+  //<= because we want to access the '\0' too
+  for (size_t i = 2; i <= strlen(path); i++) {
+    while (path[i] != '/' && path[i] != '\0') {
+      if (position < nameSize - 1) {
+        name[position++] = path[i++];
+      } else {
+        nameSize *= 2;
+        char* newName = malloc(nameSize);
+        if (newName == NULL)
+          failErrno(23, "Error allocating memory for the name");
+        strncpy(newName, name, nameSize/2);
+        char* toDelete = name;
+        name = newName;
+        free(toDelete);
+        name[position++] = path[i++];
+      }
+    }
+
+    name[position] = '\0';
+    position = 0;
+  }
+  
+  addToDir(fs, path, name, 'd');
+  freeHeld(&name);
+}
+
+//BDSM_COPY=buffer turns off the copies done by the kernel, e.g. to compare the two
+static bool kernelCopyEnabled(void) {
+  char* mode = getenv("BDSM_COPY");
+  if (mode == NULL || strcmp(mode, "kernel") == 0)
+    return true;
+  if (strcmp(mode, "buffer") != 0)
+    fail(1, "BDSM_COPY must be either kernel or buffer");
+  return false;
+}
+
+//maps length bytes of the file from offset read-only, mmap wants an offset which is a multiple of the page size
+static char* mapRange(int fd, off_t offset, size_t length, void** mapping, size_t* mapLength) {
+  off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+  *mapLength = length + (offset - start);
+  *mapping = mmap(NULL, *mapLength, PROT_READ, MAP_SHARED, fd, start);
+  if (*mapping == MAP_FAILED)
+    return NULL;
+  return (char*)*mapping + (offset - start);
+}
+
+//copies bytes from offset of the host file to count datablocks from db without a buffer: the kernel
+//copies the data (and may share the blocks if the host file system has reflinks), and the checksums
+//are computed from a read-only mapping of the host file. Returns false if the kernel can't copy
+//between the two files, the caller writes the run through the buffer then
+static bool copyRangeToImage(FileSystem* fs, int fd, off_t offset, int32_t db, uint32_t count, size_t bytes) {
+  void* mapping;
+  size_t mapLength;
+  char* data = mapRange(fd, offset, bytes, &mapping, &mapLength);
+  if (data == NULL)
+    return false;
+  int64_t first = datablockPosition(fs, db);
+  loff_t from = offset;
+  loff_t to = first * fs->blockSize;
+  for (size_t copied = 0; copied < bytes; ) {
+    ssize_t result = copy_file_range(fd, &from, fs->fd, &to, bytes - copied, 0);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      munmap(mapping, mapLength);
+      return false;
+    }
+    copied += result;
+  }
+
+  //the rest of the last block is cleared, as when it is written from the buffer
+  char block[fs->blockSize];
+  size_t tail = bytes % fs->blockSize;
+  if (tail != 0) {
+    memset(block, 0, fs->blockSize);
+    imagePwrite(fs, block, fs->blockSize - tail, first * fs->blockSize + bytes, 7, "Error writing blocks of the file system");
+    memcpy(block, data + bytes - tail, tail);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    char* blockData = tail != 0 && i == count - 1 ? block : data + (size_t)i * fs->blockSize;
+    setChecksum(fs, first + i, blockChecksum(fs, blockData));
+    dropCachedBlock(fs, first + i);
+  }
+  revokeReplay(fs, first, count);
+  munmap(mapping, mapLength);
+  return true;
+}
+
+//the opposite of copyRangeToImage: the blocks are checked through a mapping of the image and the
+//kernel copies bytes of them to fd with copy_file_range, or with sendfile if fd is a pipe.
+//Returns how many bytes were copied, the caller writes the rest through the buffer
+static size_t copyRangeFromImage(FileSystem* fs, int64_t first, uint32_t count, size_t bytes, int fd) {
+  if (fs->map != NULL) {
+    verifyBlockRun(fs, first, count, fs->map + first * fs->blockSize);
+  } else {
+    //a block in the cache may be newer than the one in the image
+    for (uint32_t i = 0; i < count; i++) {
+      if (findCachedBlock(&fs->cache, first + i) != NULL)
+        return 0;
+    }
+    void* mapping;
+    size_t mapLength;
+    char* data = mapRange(fs->fd, first * fs->blockSize, (size_t)count * fs->blockSize, &mapping, &mapLength);
+    if (data == NULL)
+      return 0;
+    for (uint32_t i = 0; i < count; i++) {
+      if (!checksumMatches(fs, first + i, data + (size_t)i * fs->blockSize)) {
+        munmap(mapping, mapLength);
+        fail(31, "Checksum mismatch in block %lld of the file system", (long long)(first + i));
+      }
+    }
+    munmap(mapping, mapLength);
+  }
+
+  loff_t from = first * fs->blockSize;
+  size_t copied = 0;
+  bool copyRange = true;
+  while (copied < bytes) {
+    ssize_t result;
+    if (copyRange) {
+      result = copy_file_range(fs->fd, &from, fd, NULL, bytes - copied, 0);
+    } else {
+      off_t position = from;
+      result = sendfile(fd, fs->fd, &position, bytes - copied);
+    }
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result < 0 && copyRange) {
+      copyRange = false;
+      continue;
+    }
+    if (result <= 0)
+      break;
+    from += result;
+    copied += result;
+  }
+  return copied;
+}
+
+//the permissions are kept in base 10, e.g. 644
+static uint16_t permissionsFromMode(mode_t modes) {
+  uint16_t permissions = 0;
+  if (modes & S_IRUSR)
+    permissions += 400;
+  if (modes & S_IWUSR)
+    permissions += 200;
+  if (modes & S_IXUSR)
+    permissions += 100;
+  if (modes & S_IRGRP)
+    permissions += 40;
+  if (modes & S_IWGRP)
+    permissions += 20;
+  if (modes & S_IXGRP)
+    permissions += 10;
+  if (modes & S_IROTH)
+    permissions += 4;
+  if (modes & S_IWOTH)
+    permissions += 2;
+  if (modes & S_IXOTH)
+    permissions += 1;
+  return permissions;
+}
+
+static mode_t modeFromPermissions(uint16_t permissions) {
+  return (permissions / 100 % 10) << 6 | (permissions / 10 % 10) << 3 | permissions % 10;
+}
+
+static uint32_t blocksForSize(FileSystem* fs, uint32_t size) {
+  return size / fs->blockSize + (size % fs->blockSize == 0 ? 0 : 1);
+}
+
+//BDSM_COMPRESS=lz compresses the files written by cpfile and import, the compressed files already
+//in the image are read whatever it is set to
+static bool compressionEnabled(void) {
+  char* mode = getenv("BDSM_COMPRESS");
+  if (mode == NULL || strcmp(mode, "none") == 0)
+    return false;
+  if (strcmp(mode, "lz") != 0)
+    fail(1, "BDSM_COMPRESS must be either none or lz");
+  return true;
+}
+
+static bool isCompressed(Inode* in) {
+  return in->reserved & inodeFlagCompressed;
+}
+
+static uint32_t chunksForSize(uint32_t size) {
+  return size / compressChunkBytes + (size % compressChunkBytes == 0 ? 0 : 1);
+}
+
+//the table with the stored length of every chunk, which comes after the last chunk
+static uint32_t chunkTableBlocks(FileSystem* fs, uint32_t size) {
+  return blocksForSize(fs, chunksForSize(size) * sizeof(uint32_t));
+}
+
+//compresses a chunk of a file into out, which has room for its blocks, and clears the rest of the
+//last block. A chunk which doesn't get shorter is kept as it is, so its stored length is its size
+static uint32_t compressChunk(FileSystem* fs, char* data, uint32_t size, char* out) {
+  uint32_t stored = lzCompress((uint8_t*)data, size, (uint8_t*)out);
+  if (stored == size)
+    memcpy(out, data, size);
+  memset(out + stored, 0, (size_t)blocksForSize(fs, stored) * fs->blockSize - stored);
+  return stored;
+}
+
+//the stored form of a whole file in memory: its chunks, each starting in a new block, and the table.
+//NULL if there is no memory
+static char* compressFile(FileSystem* fs, char* data, uint32_t size, uint32_t* blocks) {
+  uint32_t chunks = chunksForSize(size);
+  char* stored = malloc(((size_t)blocksForSize(fs, size) + chunkTableBlocks(fs, size)) * fs->blockSize);
+  uint32_t* table = malloc(chunks * sizeof(uint32_t));
+  if (stored == NULL || table == NULL) {
+    free(stored);
+    free(table);
+    return NULL;
+  }
+  *blocks = 0;
+  for (uint32_t i = 0; i < chunks; i++) {
+    uint32_t length = size - i * compressChunkBytes < compressChunkBytes ? size - i * compressChunkBytes : compressChunkBytes;
+    table[i] = compressChunk(fs, data + (size_t)i * compressChunkBytes, length, stored + (size_t)*blocks * fs->blockSize);
+    *blocks += blocksForSize(fs, table[i]);
+  }
+  memset(stored + (size_t)*blocks * fs->blockSize, 0, (size_t)chunkTableBlocks(fs, size) * fs->blockSize);
+  memcpy(stored + (size_t)*blocks * fs->blockSize, table, chunks * sizeof(uint32_t));
+  *blocks += chunkTableBlocks(fs, size);
+  free(table);
+  return stored;
+}
+
+//reads blocks datablocks of the file from its index-th one, following the extents
+static void readFileBlocks(FileSystem* fs, Extent* extents, int count, uint32_t index, uint32_t blocks, char* buffer) {
+  while (blocks > 0) {
+    uint32_t left;
+    int64_t position = datablockPosition(fs, extentRun(extents, count, index, &left));
+    uint32_t part = blocks < left ? blocks : left;
+    readBlockRun(fs, position, part, buffer);
+    verifyBlockRun(fs, position, part, buffer);
+    buffer += (size_t)part * fs->blockSize;
+    index += part;
+    blocks -= part;
+  }
+}
+
+static void writeFileBlocks(FileSystem* fs, Extent* extents, int count, uint32_t index, uint32_t blocks, char* buffer) {
+  while (blocks > 0) {
+    uint32_t left;
+    int64_t position = datablockPosition(fs, extentRun(extents, count, index, &left));
+    uint32_t part = blocks < left ? blocks : left;
+    writeBlockRun(fs, position, part, buffer);
+    buffer += (size_t)part * fs->blockSize;
+    index += part;
+    blocks -= part;
+  }
+}
+
+//a compressed file opened for reading its chunks
+typedef struct {
+  uint32_t size;
+  Extent* extents;
+  int count;
+  uint32_t chunks;
+  //the stored length of every chunk and the block it starts with
+  uint32_t* lengths;
+  uint32_t* firstBlocks;
+  char* stored;
+} CompressedFile;
+
+//the table is in the last blocks of the file, the chunks are before it one after another
+static void openCompressed(FileSystem* fs, Inode* in, CompressedFile* file) {
+  file->size = in->size;
+  file->extents = loadExtents(fs, in, &file->count);
+  holdMemory(&file->extents);
+  file->chunks = chunksForSize(in->size);
+  uint32_t tableBlocks = chunkTableBlocks(fs, in->size);
+  uint32_t blocks = extentsLength(file->extents, file->count);
+  file->lengths = malloc((size_t)tableBlocks * fs->blockSize);
+  holdMemory(&file->lengths);
+  file->firstBlocks = malloc(file->chunks * sizeof(uint32_t));
+  holdMemory(&file->firstBlocks);
+  file->stored = malloc(compressChunkBytes);
+  holdMemory(&file->stored);
+  if (file->lengths == NULL || file->firstBlocks == NULL || file->stored == NULL)
+    failErrno(23, "Error allocating memory for the compressed file");
+  if (blocks < tableBlocks)
+    fail(10, "The file system is corrupted");
+  readFileBlocks(fs, file->extents, file->count, blocks - tableBlocks, tableBlocks, (char*)file->lengths);
+  uint32_t first = 0;
+  for (uint32_t i = 0; i < file->chunks; i++) {
+    uint32_t size = in->size - i * compressChunkBytes < compressChunkBytes ? in->size - i * compressChunkBytes : compressChunkBytes;
+    if (file->lengths[i] == 0 || file->lengths[i] > size)
+      fail(10, "The file system is corrupted");
+    file->firstBlocks[i] = first;
+    first += blocksForSize(fs, file->lengths[i]);
+  }
+  if (first + tableBlocks != blocks)
+    fail(10, "The file system is corrupted");
+}
+
+//decompresses the chunk into out, which has room for compressChunkBytes, and returns its size
+static uint32_t readChunk(FileSystem* fs, CompressedFile* file, uint32_t chunk, char* out) {
+  uint32_t size = file->size - chunk * compressChunkBytes < compressChunkBytes ? file->size - chunk * compressChunkBytes : compressChunkBytes;
+  uint32_t length = file->lengths[chunk];
+  readFileBlocks(fs, file->extents, file->count, file->firstBlocks[chunk], blocksForSize(fs, length), file->stored);
+  if (length == size)
+    memcpy(out, file->stored, size);
+  else if (!lzDecompress((uint8_t*)file->stored, length, (uint8_t*)out, size))
+    fail(10, "The file system is corrupted");
+  return size;
+}
+
+static void closeCompressed(CompressedFile* file) {
+  freeHeld(&file->extents);
+  freeHeld(&file->lengths);
+  freeHeld(&file->firstBlocks);
+  freeHeld(&file->stored);
+}
+
+//gives the file, which has no datablocks, count new ones in as long runs as possible
+static void allocateFileBlocks(FileSystem* fs, Inode* in, uint32_t count) {
+  int extentCount = 0;
+  Extent* extents = NULL;
+  for (uint32_t allocated = 0; allocated < count; ) {
+    uint32_t length;
+    int32_t start = allocateRun(fs, count - allocated, &length);
+    appendExtent(&extents, &extentCount, start, length);
+    allocated += length;
+  }
+  storeExtents(fs, in, extents, extentCount);
+  free(extents);
+}
+
+//a compressed file is written through a handle as a plain one, so it is decompressed into new
+//datablocks first and its old blocks are freed. The caller updates the inode
+static void decompressFile(FileSystem* fs, Inode* in) {
+  if (blocksForSize(fs, in->size) > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+    fail(17, "Not enough free datablocks to decompress the file");
+  CompressedFile file;
+  openCompressed(fs, in, &file);
+  //the new blocks get their own extents, which replace the old ones at the end
+  Inode plain = *in;
+  plain.indirect = -1;
+  allocateFileBlocks(fs, &plain, blocksForSize(fs, in->size));
+  int count;
+  Extent* extents = loadExtents(fs, &plain, &count);
+  holdMemory(&extents);
+  char* data = malloc(compressChunkBytes);
+  if (data == NULL)
+    failErrno(23, "Error allocating memory for the compressed file");
+  holdMemory(&data);
+  for (uint32_t i = 0; i < file.chunks; i++) {
+    uint32_t size = readChunk(fs, &file, i, data);
+    memset(data + size, 0, (size_t)blocksForSize(fs, size) * fs->blockSize - size);
+    writeFileBlocks(fs, extents, count, i * compressChunkBlocks(fs), blocksForSize(fs, size), data);
+  }
+  freeHeld(&data);
+  closeCompressed(&file);
+  freeHeld(&extents);
+  freeFileBlocks(fs, in);
+  memcpy(in->extents, plain.extents, sizeof(in->extents));
+  in->indirect = plain.indirect;
+}
+
+//a file written with dedup is changed in place through a handle, so it stops sharing its datablocks
+//first. The ones no other file uses are just taken out of the index, but if any of them is shared
+//the whole file is copied to new datablocks. The caller updates the inode
+static void unshareFile(FileSystem* fs, Inode* in) {
+  int count;
+  Extent* extents = loadExtents(fs, in, &count);
+  holdMemory(&extents);
+  uint32_t blocks = extentsLength(extents, count);
+  bool shared = false;
+  for (int i = 0; i < count && !shared; i++) {
+    for (uint32_t j = 0; j < extents[i].length && !shared; j++) {
+      shared = referenceCount(fs, extents[i].start + j) > 1;
+    }
+  }
+  if (!shared) {
+    for (int i = 0; i < count; i++) {
+      for (uint32_t j = 0; j < extents[i].length; j++) {
+        if (referenceCount(fs, extents[i].start + j) == 1)
+          untrackBlock(fs, extents[i].start + j);
+      }
+    }
+  } else {
+    if (blocks > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+      fail(17, "Not enough free datablocks to unshare the file");
+    Inode copy = *in;
+    copy.indirect = -1;
+    allocateFileBlocks(fs, &copy, blocks);
+    int copyCount;
+    Extent* copyExtents = loadExtents(fs, &copy, &copyCount);
+    holdMemory(&copyExtents);
+    char* buffer = allocBlocks(fs, copyChunkBlocks(fs));
+    if (buffer == NULL)
+      failErrno(23, "Error allocating memory for writing the file");
+    holdMemory(&buffer);
+    for (uint32_t done = 0; done < blocks; done += copyChunkBlocks(fs)) {
+      uint32_t part = blocks - done < copyChunkBlocks(fs) ? blocks - done : copyChunkBlocks(fs);
+      readFileBlocks(fs, extents, count, done, part, buffer);
+      writeFileBlocks(fs, copyExtents, copyCount, done, part, buffer);
+    }
+    freeHeld(&buffer);
+    freeHeld(&copyExtents);
+    freeFileBlocks(fs, in);
+    memcpy(in->extents, copy.extents, sizeof(in->extents));
+    in->indirect = copy.indirect;
+  }
+  freeHeld(&extents);
+  in->reserved &= ~inodeFlagDeduped;
+}
+
+//the stream didn't fit, the blocks taken so far are given back. The inode in the image is not
+//changed, so the file stays as it was
+static void dropCopiedBlocks(FileSystem* fs, Extent* extents, int count) __attribute__((noreturn));
+
+static void dropCopiedBlocks(FileSystem* fs, Extent* extents, int count) {
+  for (int i = 0; i < count; i++) {
+    deleteDatablocks(fs, extents[i].start, extents[i].length);
+  }
+  fail(17, "The file you are trying to copy is too big");
+}
+
+//adds the blocks at the end of a file written with dedup - a block which is already in the image
+//gets one more reference instead of a datablock, the others get new tracked datablocks and go in the run
+static void writeDeduped(FileSystem* fs, Inode* in, Extent** extents, int* count, char* data, uint32_t blocks, RunWriter* run) {
+  in->reserved |= inodeFlagDeduped;
+  for (uint32_t i = 0; i < blocks; i++) {
+    char* block = data + (size_t)i * fs->blockSize;
+    uint32_t checksum = blockChecksum(fs, block);
+    int32_t db = findDuplicate(fs, block, checksum, run);
+    if (db != -1 && referenceCount(fs, db) < UINT32_MAX && fs->sb.dedupSaved < UINT32_MAX) {
+      setReferenceCount(fs, db, referenceCount(fs, db) + 1);
+      fs->sb.dedupSaved++;
+      fs->dedupHits++;
+    } else {
+      db = allocateDatablock(fs);
+      trackBlock(fs, db, checksum);
+      addToRun(fs, run, datablockPosition(fs, db), 1, block);
+      fs->dedupMisses++;
+    }
+    appendExtent(extents, count, db, 1);
+  }
+  markSuperblockDirty(fs);
+}
+
+//writes the staged blocks to new datablocks at the end of the file
+static void writeStaged(FileSystem* fs, Inode* in, Extent** extents, int* count, char* staged, uint32_t blocks) {
+  if (blocks > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+    dropCopiedBlocks(fs, *extents, *count);
+  if (dedupEnabled(fs)) {
+    RunWriter run;
+    memset(&run, 0, sizeof(run));
+    run.buffer = allocBlocks(fs, copyChunkBlocks(fs));
+    if (run.buffer == NULL)
+      failErrno(23, "Error allocating memory for copying the file");
+    holdMemory(&run.buffer);
+    writeDeduped(fs, in, extents, count, staged, blocks, &run);
+    flushRun(fs, &run);
+    freeHeld(&run.buffer);
+    return;
+  }
+  for (uint32_t done = 0; done < blocks; ) {
+    uint32_t length;
+    int32_t start = allocateRun(fs, blocks - done, &length);
+    appendExtent(extents, count, start, length);
+    writeBlockRun(fs, datablockPosition(fs, start), length, staged + (size_t)done * fs->blockSize);
+    done += length;
+  }
+}
+
+//as copyHostData, with every chunk compressed before it is written. The compressed chunks are
+//gathered in a buffer of copyChunkBytes, which is written to new datablocks when it fills
+static void copyHostCompressed(FileSystem* fs, int fromFile, Inode* in) {
+  int extentCount = 0;
+  Extent* extents = NULL;
+  holdMemory(&extents);
+  uint32_t chunks = 0;
+  uint32_t* table = NULL;
+  holdMemory(&table);
+  char* data = malloc(compressChunkBytes);
+  holdMemory(&data);
+  char* staged = allocBlocks(fs, copyChunkBlocks(fs));
+  holdMemory(&staged);
+  if (data == NULL || staged == NULL)
+    failErrno(23, "Error allocating memory for copying the file");
+  uint32_t stagedBlocks = 0;
+  uint64_t size = 0;
+  for (;;) {
+    size_t readBytes = safeRead(fromFile, data, compressChunkBytes, 20, "Error reading data from file");
+    if (readBytes == 0)
+      break;
+    if (size == 0 && readBytes < compressChunkBytes && readBytes <= inlineDataSize) {
+      storeInline(in, data, readBytes);
+      size = readBytes;
+      break;
+    }
+    if (size + readBytes > UINT32_MAX)
+      dropCopiedBlocks(fs, extents, extentCount);
+    if (stagedBlocks + compressChunkBlocks(fs) > copyChunkBlocks(fs)) {
+      writeStaged(fs, in, &extents, &extentCount, staged, stagedBlocks);
+      stagedBlocks = 0;
+    }
+    uint32_t* grown = realloc(table, (chunks + 1) * sizeof(uint32_t));
+    if (grown == NULL)
+      failErrno(23, "Error allocating memory for copying the file");
+    table = grown;
+    table[chunks] = compressChunk(fs, data, readBytes, staged + (size_t)stagedBlocks * fs->blockSize);
+    stagedBlocks += blocksForSize(fs, table[chunks++]);
+    size += readBytes;
+    //safeRead stops early only at the end of the stream
+    if (readBytes < compressChunkBytes)
+      break;
+  }
+  if (chunks > 0) {
+    uint32_t tableBlocks = blocksForSize(fs, chunks * sizeof(uint32_t));
+    if (stagedBlocks + tableBlocks > copyChunkBlocks(fs)) {
+      writeStaged(fs, in, &extents, &extentCount, staged, stagedBlocks);
+      stagedBlocks = 0;
+    }
+    memset(staged + (size_t)stagedBlocks * fs->blockSize, 0, (size_t)tableBlocks * fs->blockSize);
+    memcpy(staged + (size_t)stagedBlocks * fs->blockSize, table, chunks * sizeof(uint32_t));
+    writeStaged(fs, in, &extents, &extentCount, staged, stagedBlocks + tableBlocks);
+    in->reserved |= inodeFlagCompressed;
+  }
+  freeHeld(&table);
+  freeHeld(&staged);
+  freeHeld(&data);
+  storeExtents(fs, in, extents, extentCount);
+  freeHeld(&extents);
+  in->size = size;
+}
+
+//fills the file with the inode in, which has no datablocks, with the data of the host file. It is
+//read in chunks of copyChunkBytes and the datablocks are allocated as the data arrives,
+//so fromFile can also be a pipe or stdin, whose size is known only when they end
+static void copyHostData(FileSystem* fs, int fromFile, struct stat* fromStat, Inode* in) {
+  if (compressionEnabled()) {
+    copyHostCompressed(fs, fromFile, in);
+    return;
+  }
+  //the size of a regular file is known, so it is refused before any of it is copied
+  if (S_ISREG(fromStat->st_mode) && fromStat->st_size > inlineDataSize && blocksForSize(fs, fromStat->st_size) > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+    fail(17, "The file you are trying to copy is too big");
+
+  //every chunk is written with one write to as long runs of datablocks as possible, each run
+  //becomes an extent or grows the last one
+  int extentCount = 0;
+  Extent* extents = NULL;
+  holdMemory(&extents);
+  size_t chunkSize = copyChunkBytes;
+  char* data = allocBlocks(fs, copyChunkBlocks(fs));
+  if (data == NULL)
+    failErrno(23, "Error allocating memory for copying the file");
+  holdMemory(&data);
+  //a regular file is copied by the kernel run by run, everything else, the runs the kernel refuses
+  //and the blocks which have to be looked up for dedup go through the buffer
+  bool kernelCopy = S_ISREG(fromStat->st_mode) && fromFile != 0 && fs->map == NULL && !fs->direct && !dedupEnabled(fs) && kernelCopyEnabled();
+  uint64_t size = 0;
+  for (;;) {
+    size_t readBytes;
+    if (kernelCopy)
+      readBytes = (uint64_t)fromStat->st_size - size < chunkSize ? (uint64_t)fromStat->st_size - size : chunkSize;
+    else
+      readBytes = safeRead(fromFile, data, chunkSize, 20, "Error reading data from file");
+    if (readBytes == 0)
+      break;
+    //a file which ends within inlineDataSize needs no datablocks
+    if (size == 0 && readBytes < chunkSize && readBytes <= inlineDataSize) {
+      if (kernelCopy)
+        safePread(fromFile, data, readBytes, 0, 20, "Error reading data from file");
+      storeInline(in, data, readBytes);
+      size = readBytes;
+      break;
+    }
+    uint32_t count = blocksForSize(fs, readBytes);
+    if (size + readBytes > UINT32_MAX || count > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+      dropCopiedBlocks(fs, extents, extentCount);
+    if (!kernelCopy)
+      memset(data + readBytes, 0, (size_t)count * fs->blockSize - readBytes);
+    uint32_t done = 0;
+    while (kernelCopy && done < count) {
+      uint32_t length;
+      int32_t start = allocateRun(fs, count - done, &length);
+      appendExtent(&extents, &extentCount, start, length);
+      size_t offset = (size_t)done * fs->blockSize;
+      size_t runBytes = (size_t)length * fs->blockSize < readBytes - offset ? (size_t)length * fs->blockSize : readBytes - offset;
+      if (!copyRangeToImage(fs, fromFile, size + offset, start, length, runBytes)) {
+        //the rest of the chunk is read into the buffer and the next chunks are read as from a stream
+        kernelCopy = false;
+        safePread(fromFile, data + offset, readBytes - offset, size + offset, 20, "Error reading data from file");
+        memset(data + readBytes, 0, (size_t)count * fs->blockSize - readBytes);
+        if (lseek(fromFile, size + readBytes, SEEK_SET) < 0)
+          failErrno(20, "Error reading data from file");
+        writeBlockRun(fs, datablockPosition(fs, start), length, data + offset);
+      }
+      done += length;
+    }
+    if (done < count)
+      writeStaged(fs, in, &extents, &extentCount, data + (size_t)done * fs->blockSize, count - done);
+    size += readBytes;
+    //safeRead stops early only at the end of the stream
+    if (readBytes < chunkSize)
+      break;
+  }
+  freeHeld(&data);
+  storeExtents(fs, in, extents, extentCount);
+  freeHeld(&extents);
+  in->size = size;
+}
+
+static void copyToFS(FileSystem* fs, char from[], char to[]) {
+  int fromFile = strcmp(from, "-") == 0 ? 0 : open(from, O_RDONLY);
+  if (fromFile < 0)
+    failErrno(15, "Error opening file for copying");
+  if (fromFile != 0)
+    holdFd(&fromFile);
+  struct stat st;
+  if (fstat(fromFile, &st) != 0)
+    failErrno(15, "Error opening file for copying");
+  if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX)
+    fail(17, "The file you are trying to copy is too big");
+
+  int32_t inode = goToDirWithoutCheck(fs, to);
+  if (inode == -1) {
+    int nameSize = 32;
+    char* name = malloc(nameSize);
+    if (name == NULL)
+      failErrno(23, "Error allocating memory for the name");
+    holdMemory(&name);
+    int position = 0;
+
+    //<= because we want to access the '\0' too
+    for (size_t i = 2; i <= strlen(to); i++) {
+      while (to[i] != '/' && to[i] != '\0') {
+        if (position < nameSize - 1) {
+          name[position++] = to[i++];
+        } else {
+          nameSize *= 2;
+          char* newName = malloc(nameSize);
+          if (newName == NULL)
+            failErrno(23, "Error allocating memory for the name");
+          strncpy(newName, name, nameSize/2);
+          char* toDelete = name;
+          name = newName;
+          free(toDelete);
+          name[position++] = to[i++];
+        }
+      }
+      name[position] = '\0';
+      position = 0;
+    }
+    inode = addToDir(fs, to, name, 'f');
+    freeHeld(&name);
+  } 
+
+  Inode in;
+  readInode(fs, inode, &in);
+  //only a regular file can be overwritten, the blocks of a directory are its rows
+  if (in.type != 'f')
+    fail(33, "%s is a directory", to);
+  //the data goes to new datablocks and the old ones are freed only after all of it is copied, so a
+  //copy which fails or doesn't fit leaves the file as it was
+  Inode old = in;
+  in.indirect = -1;
+  storeExtents(fs, &in, NULL, 0);
+  storeInline(&in, NULL, 0);
+  in.reserved &= ~(inodeFlagCompressed | inodeFlagDeduped);
+  copyHostData(fs, fromFile, &st, &in);
+  freeFileBlocks(fs, &old);
+  if (fromFile != 0) {
+    letGo(&fromFile);
+    close(fromFile);
+  }
+
+  //a pipe has no permissions of its own, so the data from it gets the ones of a new file
+  if (!S_ISREG(st.st_mode))
+    st.st_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  in.permissions = permissionsFromMode(st.st_mode);
+  in.UID = st.st_uid;
+  in.GID = st.st_gid;
+  
+  updateInode(fs, &in);
+}
+
+//reads the runs with the I/O engine and writes the first bytes of them to fileToWrite
+static void writeRunsToHost(FileSystem* fs, BlockRun* runs, int count, char* buffer, size_t bytes, int fileToWrite) {
+  readBlockRuns(fs, &fs->io, runs, count, buffer);
+  char* data = buffer;
+  for (int i = 0; i < count; i++) {
+    verifyBlockRun(fs, runs[i].first, runs[i].count, data);
+    data += (size_t)runs[i].count * fs->blockSize;
+  }
+  safeWrite(fileToWrite, buffer, bytes, 19, "Error writing to file");
+}
+
+//writes the data of the file with the inode in to fileToWrite in chunks as it is read. Without the
+//kernel copy the runs of several extents are read together, so that the queue of the engine is full
+static void copyImageData(FileSystem* fs, Inode* in, int fileToWrite) {
+  if (isInline(in)) {
+    safeWrite(fileToWrite, in->inlineData, in->size, 19, "Error writing to file");
+    return;
+  }
+  if (isCompressed(in)) {
+    CompressedFile file;
+    openCompressed(fs, in, &file);
+    char* data = malloc(compressChunkBytes);
+    if (data == NULL)
+      failErrno(23, "Error allocating memory for copying the file");
+    holdMemory(&data);
+    for (uint32_t i = 0; i < file.chunks; i++) {
+      uint32_t size = readChunk(fs, &file, i, data);
+      safeWrite(fileToWrite, data, size, 19, "Error writing to file");
+    }
+    freeHeld(&data);
+    closeCompressed(&file);
+    return;
+  }
+  int extentCount;
+  Extent* extents = loadExtents(fs, in, &extentCount);
+  holdMemory(&extents);
+  uint32_t bufferBlocks = batchBlocks(fs);
+  char* buffer = allocBlocks(fs, bufferBlocks);
+  holdMemory(&buffer);
+  BlockRun* runs = malloc((extentCount > 0 ? extentCount : 1) * sizeof(BlockRun));
+  holdMemory(&runs);
+  if (buffer == NULL || runs == NULL)
+    failErrno(23, "Error allocating memory for copying the file");
+  bool kernelCopy = kernelCopyEnabled() && !fs->direct;
+  //the runs waiting in the buffer, only the last one can end before its last block
+  int runCount = 0;
+  uint32_t batched = 0;
+  size_t batchedBytes = 0;
+  uint32_t left = in->size;
+  for (int i = 0; i < extentCount && left > 0; i++) {
+    for (uint32_t done = 0; done < extents[i].length && left > 0; ) {
+      uint32_t limit = kernelCopy ? copyChunkBlocks(fs) : bufferBlocks - batched;
+      uint32_t count = extents[i].length - done < limit ? extents[i].length - done : limit;
+      size_t bytes = (size_t)count * fs->blockSize < left ? (size_t)count * fs->blockSize : left;
+      int64_t first = datablockPosition(fs, extents[i].start + done);
+      size_t copied = kernelCopy ? copyRangeFromImage(fs, first, count, bytes, fileToWrite) : 0;
+      //after the kernel refuses once the rest goes through the buffer
+      if (copied == 0)
+        kernelCopy = false;
+      if (copied > 0 && copied < bytes) {
+        readBlockRun(fs, first, count, buffer);
+        verifyBlockRun(fs, first, count, buffer);
+        safeWrite(fileToWrite, buffer + copied, bytes - copied, 19, "Error writing to file");
+      } else if (copied == 0) {
+        runs[runCount].first = first;
+        runs[runCount++].count = count;
+        batched += count;
+        batchedBytes += bytes;
+      }
+      if (batched == bufferBlocks) {
+        writeRunsToHost(fs, runs, runCount, buffer, batchedBytes, fileToWrite);
+        runCount = 0;
+        batched = 0;
+        batchedBytes = 0;
+      }
+      left -= bytes;
+      done += count;
+    }
+  }
+  if (runCount > 0)
+    writeRunsToHost(fs, runs, runCount, buffer, batchedBytes, fileToWrite);
+  freeHeld(&runs);
+  freeHeld(&buffer);
+  freeHeld(&extents);
+}
+
+//to can be - for stdout, so nothing has to be staged. An existing host file is truncated, so a
+//shorter copy doesn't leave the end of the old content, but only after the source is found
+static void copyFromFS(FileSystem* fs, char from[], char to[]) {
+  int32_t inode = goToDirWithoutCheck(fs, from);
+  if (inode == -1)
+    fail(18, "Nonexistant file in the file system");
+  int fileToWrite = strcmp(to, "-") == 0 ? 1 : open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fileToWrite < 0)
+    failErrno(16, "Error opening the file for writing");
+  if (fileToWrite != 1)
+    holdFd(&fileToWrite);
+  Inode in;
+  readInode(fs, inode, &in);
+  copyImageData(fs, &in, fileToWrite);
+  if (fileToWrite != 1) {
+    letGo(&fileToWrite);
+    close(fileToWrite);
+  }
+}
+
+//the last component of the path, the name under which the object is in its directory
+static char* lastName(char path[]) {
+  char* name = strrchr(path, '/');
+  return name == NULL ? path : name + 1;
+}
+
+static void fillStat(Inode* in, char name[], BdsmStat* st) {
+  memset(st, 0, sizeof(*st));
+  strncpy(st->name, name, sizeof(st->name) - 1);
+  st->inode = in->id;
+  st->type = in->type;
+  st->uid = in->UID;
+  st->gid = in->GID;
+  st->permissions = in->permissions;
+  st->size = in->size;
+  st->mtime = in->mod_time;
+}
+
+//a row of the listed directory and its place in the directory
+typedef struct {
+  DirectoryRow* row;
+  int index;
+} ListedRow;
+
+static int compareRowsByInode(const void* a, const void* b) {
+  uint32_t first = ((ListedRow*)a)->row->inodeNum;
+  uint32_t second = ((ListedRow*)b)->row->inodeNum;
+  return (first > second) - (first < second);
+}
+
+//reads the inodes of all rows at once: the rows are sorted by inode number and the blocks of the
+//inode table which hold them are grouped in runs of up to inodeChunkBytes of neighbouring blocks, and
+//as many runs as fit in the buffer are read together by the I/O engine, so a large directory costs a
+//few batches of big reads instead of a random read for every row. entries[i] is filled for rows[i]
+static void readDirPlus(FileSystem* fs, DirectoryRow* rows, int count, BdsmStat* entries) {
+  uint32_t bufferBlocks = batchBlocks(fs);
+  ListedRow* order = malloc((count > 0 ? count : 1) * sizeof(ListedRow));
+  holdMemory(&order);
+  BlockRun* runs = malloc((count > 0 ? count : 1) * sizeof(BlockRun));
+  holdMemory(&runs);
+  char* buffer = allocBlocks(fs, bufferBlocks);
+  holdMemory(&buffer);
+  if (order == NULL || runs == NULL || buffer == NULL)
+    failErrno(23, "Error allocating memory for the directory listing");
+  for (int i = 0; i < count; i++) {
+    order[i].row = &rows[i];
+    order[i].index = i;
+  }
+  qsort(order, count, sizeof(ListedRow), compareRowsByInode);
+
+  uint32_t perBlock = fs->sb.inodesPerDatablock;
+  for (int i = 0; i < count; ) {
+    int batchStart = i;
+    int runCount = 0;
+    uint32_t batched = 0;
+    while (i < count) {
+      uint32_t first = order[i].row->inodeNum / perBlock;
+      int end = i;
+      while (end < count && order[end].row->inodeNum / perBlock - first < inodeChunkBlocks(fs))
+        end++;
+      uint32_t blocks = order[end - 1].row->inodeNum / perBlock - first + 1;
+      if (batched + blocks > bufferBlocks)
+        break;
+      runs[runCount].first = fs->sb.inodeTableStart + first;
+      runs[runCount++].count = blocks;
+      batched += blocks;
+      i = end;
+    }
+    readBlockRuns(fs, &fs->io, runs, runCount, buffer);
+    char* data = buffer;
+    for (int r = 0; r < runCount; r++) {
+      verifyBlockRun(fs, runs[r].first, runs[r].count, data);
+      data += (size_t)runs[r].count * fs->blockSize;
+    }
+    data = buffer;
+    int r = 0;
+    for (int k = batchStart; k < i; k++) {
+      uint32_t id = order[k].row->inodeNum;
+      while (id / perBlock >= runs[r].first - fs->sb.inodeTableStart + runs[r].count) {
+        data += (size_t)runs[r].count * fs->blockSize;
+        r++;
+      }
+      Inode in;
+      memcpy(&in, data + (size_t)(id - (runs[r].first - fs->sb.inodeTableStart) * perBlock) * sizeof(Inode), sizeof(Inode));
+      fillStat(&in, order[k].row->name, &entries[order[k].index]);
+    }
+  }
+  freeHeld(&buffer);
+  freeHeld(&runs);
+  freeHeld(&order);
+}
+
+static BdsmStat* listDirInode(FileSystem* fs, uint32_t inode, int* count) {
+  Inode in;
+  readInode(fs, inode, &in);
+
+  DirectoryRow* rows = readDirRows(fs, &in, count);
+
+  holdMemory(&rows);
+  BdsmStat* entries = malloc((*count > 0 ? *count : 1) * sizeof(BdsmStat));
+  holdMemory(&entries);
+  if (entries == NULL)
+    failErrno(23, "Error allocating memory for the directory listing");
+  readDirPlus(fs, rows, *count, entries);
+  freeHeld(&rows);
+  letGo(&entries);
+  return entries;
+}
+
+static BdsmStat* listDir(FileSystem* fs, char path[], int* count) {
+  return listDirInode(fs, goToDir(fs, path), count);
+}
+
+static void statObject(FileSystem* fs, char path[], BdsmStat* st) {
+  if (strcmp(path, "+/") != 0 && !validatePath(path))
+    fail(12, "Invalid path");
+  uint32_t inode = goToDir(fs, path);
+  Inode in;
+  readInode(fs, inode, &in);
+  fillStat(&in, inode == 0 ? "+" : lastName(path), st);
+}
+
+struct BdsmFile {
+  FileSystem* fs;
+  uint32_t inode;
+  int64_t position;
+};
+
+static BdsmFile* openFile(FileSystem* fs, char path[], bool create) {
+  int32_t inode = goToDirWithoutCheck(fs, path);
+  Inode in;
+  if (inode == -1) {
+    if (!create)
+      fail(18, "Nonexistant file in the file system");
+    if (!validatePath(path))
+      fail(12, "Invalid path");
+    inode = addToDir(fs, path, lastName(path), 'f');
+    readInode(fs, inode, &in);
+    in.UID = getuid();
+    in.GID = getgid();
+    in.permissions = 644;
+    updateInode(fs, &in);
+  }
+  readInode(fs, inode, &in);
+  if (in.type != 'f')
+    fail(33, "Not a regular file");
+  BdsmFile* file = malloc(sizeof(BdsmFile));
+  if (file == NULL)
+    failErrno(23, "Error allocating memory for the file handle");
+  file->fs = fs;
+  file->inode = inode;
+  file->position = 0;
+  return file;
+}
+
+//copies size bytes from offset of the file, which has to be inside it, reading only the blocks in the range
+static void readFileRange(FileSystem* fs, Inode* in, uint32_t offset, char* data, uint32_t size) {
+  if (size == 0)
+    return;
+  if (isInline(in)) {
+    memcpy(data, in->inlineData + offset, size);
+    return;
+  }
+  if (isCompressed(in)) {
+    //only the chunks in the range are decompressed
+    CompressedFile file;
+    openCompressed(fs, in, &file);
+    char* chunk = malloc(compressChunkBytes);
+    if (chunk == NULL)
+      failErrno(23, "Error allocating memory for reading the file");
+    holdMemory(&chunk);
+    for (uint32_t done = 0; done < size; ) {
+      uint32_t position = offset + done;
+      readChunk(fs, &file, position / compressChunkBytes, chunk);
+      uint32_t bytes = compressChunkBytes - position % compressChunkBytes;
+      if (bytes > size - done)
+        bytes = size - done;
+      memcpy(data + done, chunk + position % compressChunkBytes, bytes);
+      done += bytes;
+    }
+    freeHeld(&chunk);
+    closeCompressed(&file);
+    return;
+  }
+  int count;
+  Extent* extents = loadExtents(fs, in, &count);
+  holdMemory(&extents);
+  char* buffer = allocBlocks(fs, copyChunkBlocks(fs));
+  if (buffer == NULL)
+    failErrno(23, "Error allocating memory for reading the file");
+  holdMemory(&buffer);
+  uint32_t lastBlock = (offset + size - 1) / fs->blockSize;
+  for (uint32_t done = 0; done < size; ) {
+    uint32_t position = offset + done;
+    uint32_t left;
+    int32_t db = extentRun(extents, count, position / fs->blockSize, &left);
+    uint32_t blocks = lastBlock - position / fs->blockSize + 1;
+    if (blocks > left)
+      blocks = left;
+    if (blocks > copyChunkBlocks(fs))
+      blocks = copyChunkBlocks(fs);
+    readBlockRun(fs, datablockPosition(fs, db), blocks, buffer);
+    verifyBlockRun(fs, datablockPosition(fs, db), blocks, buffer);
+    uint32_t bytes = blocks * fs->blockSize - position % fs->blockSize;
+    if (bytes > size - done)
+      bytes = size - done;
+    memcpy(data + done, buffer + position % fs->blockSize, bytes);
+    done += bytes;
+  }
+  freeHeld(&buffer);
+  freeHeld(&extents);
+}
+
+//a block at the edge of a write keeps the bytes around the written part, a block past the old end
+//of the file has nothing to keep and is just cleared
+static void readKeptBlock(FileSystem* fs, uint32_t oldSize, uint32_t index, int64_t position, char* block) {
+  if ((uint64_t)index * fs->blockSize < oldSize) {
+    readBlockRun(fs, position, 1, block);
+    verifyBlockRun(fs, position, 1, block);
+  } else {
+    memset(block, 0, fs->blockSize);
+  }
+}
+
+//writes size bytes at offset of the file, or zeroes if data is NULL. The missing datablocks are
+//allocated at the end of the file, and only the first and the last block of the range are read.
+//The caller updates the inode
+static void writeFileRange(FileSystem* fs, Inode* in, uint32_t offset, char* data, uint32_t size) {
+  if (size == 0)
+    return;
+  uint32_t end = offset + size;
+  //a file without datablocks stays in the inode while it fits there
+  if (end <= inlineDataSize && (isInline(in) || in->size == 0)) {
+    if (data != NULL)
+      memcpy(in->inlineData + offset, data, size);
+    else
+      memset(in->inlineData + offset, 0, size);
+    in->reserved |= inodeFlagInline;
+    if (end > in->size)
+      in->size = end;
+    in->mod_time = time(NULL);
+    return;
+  }
+  if (isInline(in))
+    promoteInline(fs, in);
+  if (isCompressed(in))
+    decompressFile(fs, in);
+  if (in->reserved & inodeFlagDeduped)
+    unshareFile(fs, in);
+  uint32_t oldSize = in->size;
+  int count;
+  Extent* extents = loadExtents(fs, in, &count);
+  holdMemory(&extents);
+  uint32_t have = extentsLength(extents, count);
+  uint32_t need = blocksForSize(fs, end);
+  if (need > have) {
+    if (need - have > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+      fail(17, "Not enough free datablocks for the write");
+    while (have < need) {
+      uint32_t length;
+      int32_t start = allocateRun(fs, need - have, &length);
+      appendExtent(&extents, &count, start, length);
+      have += length;
+    }
+    storeExtents(fs, in, extents, count);
+  }
+
+  char* buffer = allocBlocks(fs, copyChunkBlocks(fs));
+  if (buffer == NULL)
+    failErrno(23, "Error allocating memory for writing the file");
+
+  holdMemory(&buffer);
+  uint32_t lastBlock = (end - 1) / fs->blockSize;
+  for (uint32_t done = 0; done < size; ) {
+    uint32_t position = offset + done;
+    uint32_t index = position / fs->blockSize;
+    uint32_t left;
+    int32_t db = extentRun(extents, count, index, &left);
+    uint32_t blocks = lastBlock - index + 1;
+    if (blocks > left)
+      blocks = left;
+    if (blocks > copyChunkBlocks(fs))
+      blocks = copyChunkBlocks(fs);
+    uint32_t bytes = blocks * fs->blockSize - position % fs->blockSize;
+    if (bytes > size - done)
+      bytes = size - done;
+    int64_t first = datablockPosition(fs, db);
+    if (position % fs->blockSize != 0)
+      readKeptBlock(fs, oldSize, index, first, buffer);
+    uint32_t tail = (position + bytes) % fs->blockSize;
+    if (tail != 0 && (blocks > 1 || position % fs->blockSize == 0))
+      readKeptBlock(fs, oldSize, index + blocks - 1, first + blocks - 1, buffer + (size_t)(blocks - 1) * fs->blockSize);
+    if (data != NULL)
+      memcpy(buffer + position % fs->blockSize, data + done, bytes);
+    else
+      memset(buffer + position % fs->blockSize, 0, bytes);
+    writeBlockRun(fs, first, blocks, buffer);
+    done += bytes;
+  }
+  freeHeld(&buffer);
+  freeHeld(&extents);
+  if (end > in->size)
+    in->size = end;
+  in->mod_time = time(NULL);
+}
+
+//the datablocks past the new size are freed and the rest of the last block is cleared,
+//so that the file reads as zeroes there if it grows again
+static void truncateFile(FileSystem* fs, Inode* in, uint32_t size) {
+  if (size >= in->size) {
+    writeFileRange(fs, in, in->size, NULL, size - in->size);
+    in->mod_time = time(NULL);
+    return;
+  }
+  //a file cut down to what fits in the inode moves its data there and gives back all datablocks
+  if (size <= inlineDataSize) {
+    char kept[inlineDataSize];
+    readFileRange(fs, in, 0, kept, size);
+    freeFileBlocks(fs, in);
+    storeInline(in, kept, size);
+    in->size = size;
+    in->mod_time = time(NULL);
+    return;
+  }
+  if (isCompressed(in))
+    decompressFile(fs, in);
+  if (in->reserved & inodeFlagDeduped)
+    unshareFile(fs, in);
+  int count;
+  Extent* extents = loadExtents(fs, in, &count);
+  holdMemory(&extents);
+  uint32_t keep = blocksForSize(fs, size);
+  uint32_t have = extentsLength(extents, count);
+  while (have > keep) {
+    Extent* last = &extents[count - 1];
+    uint32_t drop = last->length < have - keep ? last->length : have - keep;
+    deleteDatablocks(fs, last->start + last->length - drop, drop);
+    last->length -= drop;
+    have -= drop;
+    if (last->length == 0)
+      count--;
+  }
+  storeExtents(fs, in, extents, count);
+  if (size % fs->blockSize != 0) {
+    int64_t position = datablockPosition(fs, extentBlock(extents, count, size / fs->blockSize));
+    char block[fs->blockSize];
+    readBlockRun(fs, position, 1, block);
+    verifyBlockRun(fs, position, 1, block);
+    memset(block + size % fs->blockSize, 0, fs->blockSize - size % fs->blockSize);
+    writeBlockRun(fs, position, 1, block);
+  }
+  freeHeld(&extents);
+  in->size = size;
+  in->mod_time = time(NULL);
+}
+
+//an object of a tree copied by import or export, every directory comes before its contents
+typedef struct {
+  char* hostPath;
+  //the name of the object in its directory, a part of hostPath
+  char* name;
+  //the index of the directory of the object, -1 for the top directory
+  int32_t parent;
+  char type;
+  uint32_t size;
+  uint16_t permissions;
+  uint16_t uid;
+  uint16_t gid;
+  uint32_t inode;
+  //the data of a small file, passed between the calling thread and the threads of the pool
+  char* data;
+  //with compression the data is already in its stored form of this many blocks, 0 if it is plain
+  uint32_t storedBlocks;
+  bool ready;
+  //errno of the host call which failed in a thread of the pool
+  int error;
+} TransferEntry;
+
+//the threads of the pool open, read and write the small host files, while everything in the image
+//is done by the calling thread, in the order of the entries
+typedef struct {
+  TransferEntry* entries;
+  uint32_t count;
+  uint32_t capacity;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  //the next entry for the threads of the pool
+  uint32_t next;
+  //the entries before this are finished by the calling thread
+  uint32_t done;
+  //bytes of small files read but not written yet, at most transferWindowBytes
+  uint64_t inFlight;
+  //the threads of the pool only read its block size
+  FileSystem* fs;
+  //BDSM_COMPRESS=lz, the small files are compressed by the threads of the pool
+  bool compress;
+  bool stop;
+  pthread_t threads[transferThreads];
+  int started;
+} Transfer;
+
+static bool isSmallFile(TransferEntry* entry) {
+  return entry->type == 'f' && entry->size <= smallFileBytes;
+}
+
+static char* joinPath(char dir[], char name[]) {
+  char* path = malloc(strlen(dir) + strlen(name) + 2);
+  if (path == NULL)
+    failErrno(23, "Error allocating memory for the copied tree");
+  sprintf(path, "%s/%s", dir, name);
+  return path;
+}
+
+static uint32_t addTransferEntry(Transfer* tr, char* hostPath, int32_t parent, char type) {
+  if (tr->count == tr->capacity) {
+    uint32_t capacity = tr->capacity == 0 ? 256 : tr->capacity * 2;
+    TransferEntry* entries = realloc(tr->entries, capacity * sizeof(TransferEntry));
+    if (entries == NULL)
+      failErrno(23, "Error allocating memory for the copied tree");
+    tr->entries = entries;
+    tr->capacity = capacity;
+  }
+  TransferEntry* entry = &tr->entries[tr->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->hostPath = hostPath;
+  entry->name = strrchr(hostPath, '/') + 1;
+  entry->parent = parent;
+  entry->type = type;
+  return tr->count++;
+}
+
+static void freeTransfer(Transfer* tr) {
+  for (uint32_t i = 0; i < tr->count; i++) {
+    free(tr->entries[i].hostPath);
+    free(tr->entries[i].data);
+  }
+  free(tr->entries);
+}
+
+static void releaseTransfer(void* tr) {
+  freeTransfer(tr);
+}
+
+static void releaseDir(void* handle) {
+  closedir(*(DIR**)handle);
+}
+
+//the paths of a host directory which aren't in the transfer yet, the ones which are are NULL
+typedef struct {
+  char** paths;
+  size_t count;
+} HostPaths;
+
+static void releaseHostPaths(void* list) {
+  HostPaths* l = list;
+  for (size_t i = 0; i < l->count; i++) {
+    free(l->paths[i]);
+  }
+  free(l->paths);
+}
+
+static void startTransferPool(Transfer* tr, void* (*worker)(void*)) {
+  pthread_mutex_init(&tr->lock, NULL);
+  pthread_cond_init(&tr->changed, NULL);
+  //the threads use tr, so the ones which started are waited for even if the rest can't start
+  while (tr->started < transferThreads && pthread_create(&tr->threads[tr->started], NULL, worker, tr) == 0) {
+    tr->started++;
+  }
+  if (tr->started == 0)
+    fail(30, "Error starting the threads for copying the tree");
+}
+
+static void stopTransferPool(Transfer* tr) {
+  pthread_mutex_lock(&tr->lock);
+  tr->stop = true;
+  pthread_cond_broadcast(&tr->changed);
+  pthread_mutex_unlock(&tr->lock);
+  for (int i = 0; i < tr->started; i++) {
+    pthread_join(tr->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&tr->lock);
+  pthread_cond_destroy(&tr->changed);
+}
+
+//the names in the image can have only letters, digits, '_' and '.', as in validatePath
+static bool validName(char name[]) {
+  size_t length = strlen(name);
+  if (length == 0 || length >= sizeof(((DirectoryRow*)NULL)->name))
+    return false;
+  for (size_t i = 0; i < length; i++) {
+    if (name[i] != '_' && name[i] != '.' && !(name[i] >= 'a' && name[i] <= 'z') &&
+        !(name[i] >= 'A' && name[i] <= 'Z') && !(name[i] >= '0' && name[i] <= '9'))
+      return false;
+  }
+  return true;
+}
+
+static int compareStrings(const void* a, const void* b) {
+  return strcmp(*(char**)a, *(char**)b);
+}
+
+//adds the contents of the host directory to the plan of the import, sorted by name
+static void walkHostDir(Transfer* tr, char dir[], int32_t parent) {
+  DIR* handle = opendir(dir);
+  if (handle == NULL)
+    failErrno(15, "Error opening %s for copying", dir);
+  hold(&handle, releaseDir);
+  HostPaths list = {NULL, 0};
+  hold(&list, releaseHostPaths);
+  size_t capacity = 0;
+  for (struct dirent* d = readdir(handle); d != NULL; d = readdir(handle)) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+      continue;
+    if (list.count == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      char** paths = realloc(list.paths, capacity * sizeof(char*));
+      if (paths == NULL)
+        failErrno(23, "Error allocating memory for the copied tree");
+      list.paths = paths;
+    }
+    list.paths[list.count] = joinPath(dir, d->d_name);
+    list.count++;
+  }
+  letGo(&handle);
+  closedir(handle);
+  char** paths = list.paths;
+  qsort(paths, list.count, sizeof(char*), compareStrings);
+
+  for (size_t i = 0; i < list.count; i++) {
+    struct stat st;
+    if (lstat(paths[i], &st) != 0)
+      failErrno(15, "Error opening %s for copying", paths[i]);
+    //links, devices and the like have no place in the image and are left out
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+      free(paths[i]);
+      paths[i] = NULL;
+      continue;
+    }
+    if (!validName(strrchr(paths[i], '/') + 1))
+      fail(12, "The name of %s can't be used in the file system", paths[i]);
+    if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX)
+      fail(17, "%s is too big for the file system", paths[i]);
+    uint32_t index = addTransferEntry(tr, paths[i], parent, S_ISDIR(st.st_mode) ? 'd' : 'f');
+    //the transfer frees the path from now on
+    paths[i] = NULL;
+    TransferEntry* entry = &tr->entries[index];
+    entry->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+    entry->permissions = permissionsFromMode(st.st_mode);
+    entry->uid = st.st_uid;
+    entry->gid = st.st_gid;
+    if (S_ISDIR(st.st_mode))
+      walkHostDir(tr, entry->hostPath, index);
+  }
+  letGo(&list);
+  free(paths);
+}
+
+//reads the whole small file in a buffer filled up to whole blocks with zeroes, runs in the pool
+static void readHostFile(FileSystem* fs, TransferEntry* entry, bool compress) {
+  if (entry->size == 0)
+    return;
+  uint32_t blocks = blocksForSize(fs, entry->size);
+  entry->data = allocBlocks(fs, blocks);
+  if (entry->data != NULL)
+    memset(entry->data, 0, (size_t)blocks * fs->blockSize);
+  int fd = entry->data == NULL ? -1 : open(entry->hostPath, O_RDONLY);
+  if (fd < 0) {
+    entry->error = errno;
+    return;
+  }
+  for (uint32_t done = 0; done < entry->size; ) {
+    ssize_t count = read(fd, entry->data + done, entry->size - done);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0)
+      entry->error = errno;
+    //a file which got shorter since the walk reads as zeroes at the end
+    if (count <= 0)
+      break;
+    done += count;
+  }
+  close(fd);
+  //the compressed form is kept only if it takes fewer blocks
+  if (compress && entry->error == 0 && entry->size > inlineDataSize) {
+    char* stored = compressFile(fs, entry->data, entry->size, &entry->storedBlocks);
+    if (stored == NULL) {
+      entry->error = ENOMEM;
+    } else if (entry->storedBlocks < blocks) {
+      free(entry->data);
+      entry->data = stored;
+    } else {
+      free(stored);
+      entry->storedBlocks = 0;
+    }
+  }
+}
+
+static void* importWorker(void* arg) {
+  Transfer* tr = arg;
+  pthread_mutex_lock(&tr->lock);
+  for (;;) {
+    while (tr->next < tr->count && !isSmallFile(&tr->entries[tr->next]))
+      tr->next++;
+    if (tr->stop || tr->next == tr->count)
+      break;
+    TransferEntry* entry = &tr->entries[tr->next];
+    //the window keeps the memory bounded, the first file after the written ones is always read
+    if (tr->inFlight > 0 && tr->inFlight + entry->size > transferWindowBytes) {
+      pthread_cond_wait(&tr->changed, &tr->lock);
+      continue;
+    }
+    tr->next++;
+    tr->inFlight += entry->size;
+    pthread_mutex_unlock(&tr->lock);
+    readHostFile(tr->fs, entry, tr->compress);
+    pthread_mutex_lock(&tr->lock);
+    entry->ready = true;
+    pthread_cond_broadcast(&tr->changed);
+  }
+  pthread_mutex_unlock(&tr->lock);
+  return NULL;
+}
+
+//gives the object of the entry its place in the image, an existing file is emptied
+static void createImported(FileSystem* fs, Transfer* tr, TransferEntry* entry, uint32_t top) {
+  uint32_t parent = entry->parent == -1 ? top : tr->entries[entry->parent].inode;
+  int32_t child = lookupDir(fs, parent, entry->name);
+  if (child == -1)
+    child = addToParent(fs, parent, entry->name, entry->type);
+  Inode in;
+  readInode(fs, child, &in);
+  if (in.type != entry->type)
+    fail(9, "%s is already in the file system as a different kind of object", entry->hostPath);
+  if (entry->type == 'f') {
+    freeFileBlocks(fs, &in);
+    in.size = 0;
+  }
+  in.permissions = entry->permissions;
+  in.UID = entry->uid;
+  in.GID = entry->gid;
+  updateInode(fs, &in);
+  entry->inode = child;
+}
+
+//the datablocks of the small files are allocated in the order of the tree before any data is written,
+//the files which fit in the inode get their data there in writeImported
+static void allocateImported(FileSystem* fs, TransferEntry* entry) {
+  if (entry->size <= inlineDataSize)
+    return;
+  Inode in;
+  readInode(fs, entry->inode, &in);
+  allocateFileBlocks(fs, &in, blocksForSize(fs, entry->size));
+  in.size = entry->size;
+  updateInode(fs, &in);
+}
+
+static void writeImported(FileSystem* fs, Transfer* tr, RunWriter* run) {
+  TransferEntry* entry = &tr->entries[tr->done];
+  if (entry->type != 'f')
+    return;
+  Inode in;
+  readInode(fs, entry->inode, &in);
+  //a big file is copied in chunks by this thread, the threads of the pool meanwhile read the next small ones
+  if (!isSmallFile(entry)) {
+    int fd = open(entry->hostPath, O_RDONLY);
+    if (fd < 0)
+      failErrno(15, "Error opening %s for copying", entry->hostPath);
+    holdFd(&fd);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      failErrno(15, "Error opening %s for copying", entry->hostPath);
+    copyHostData(fs, fd, &st, &in);
+    letGo(&fd);
+    close(fd);
+    updateInode(fs, &in);
+    return;
+  }
+
+  pthread_mutex_lock(&tr->lock);
+  while (!entry->ready)
+    pthread_cond_wait(&tr->changed, &tr->lock);
+  pthread_mutex_unlock(&tr->lock);
+  if (entry->error != 0) {
+    errno = entry->error;
+    failErrno(20, "Error reading %s", entry->hostPath);
+  }
+  if (entry->size <= inlineDataSize) {
+    storeInline(&in, entry->data, entry->size);
+    in.size = entry->size;
+    updateInode(fs, &in);
+  } else if (dedupEnabled(fs)) {
+    //with dedup the blocks are looked up one by one, so they get datablocks only now
+    int extentCount = 0;
+    Extent* extents = NULL;
+    holdMemory(&extents);
+    run->entry = tr->done;
+    writeDeduped(fs, &in, &extents, &extentCount, entry->data, entry->storedBlocks > 0 ? entry->storedBlocks : blocksForSize(fs, entry->size), run);
+    storeExtents(fs, &in, extents, extentCount);
+    freeHeld(&extents);
+    if (entry->storedBlocks > 0)
+      in.reserved |= inodeFlagCompressed;
+    in.size = entry->size;
+    updateInode(fs, &in);
+  } else {
+    //a compressed file gets its blocks only now, when the length of its stored form is known
+    if (tr->compress) {
+      allocateFileBlocks(fs, &in, entry->storedBlocks > 0 ? entry->storedBlocks : blocksForSize(fs, entry->size));
+      if (entry->storedBlocks > 0)
+        in.reserved |= inodeFlagCompressed;
+      in.size = entry->size;
+      updateInode(fs, &in);
+    }
+    int extentCount;
+    Extent* extents = loadExtents(fs, &in, &extentCount);
+    holdMemory(&extents);
+    char* data = entry->data;
+    run->entry = tr->done;
+    for (int i = 0; i < extentCount; i++) {
+      addToRun(fs, run, datablockPosition(fs, extents[i].start), extents[i].length, data);
+      data += (size_t)extents[i].length * fs->blockSize;
+    }
+    freeHeld(&extents);
+  }
+  free(entry->data);
+  entry->data = NULL;
+  pthread_mutex_lock(&tr->lock);
+  tr->inFlight -= entry->size;
+  pthread_cond_broadcast(&tr->changed);
+  pthread_mutex_unlock(&tr->lock);
+}
+
+//copies the host directory tree into the directory path of the image, which is created if needed.
+//The tree is walked and checked before anything in the image changes
+static void importTree(FileSystem* fs, char hostDir[], char path[]) {
+  if (strcmp(path, "+/") != 0 && !validatePath(path))
+    fail(12, "Invalid path");
+  struct stat st;
+  if (stat(hostDir, &st) != 0)
+    failErrno(15, "Error opening %s for copying", hostDir);
+  if (!S_ISDIR(st.st_mode))
+    fail(33, "%s is not a directory", hostDir);
+  Transfer tr;
+  memset(&tr, 0, sizeof(tr));
+  hold(&tr, releaseTransfer);
+  tr.fs = fs;
+  tr.compress = compressionEnabled();
+  walkHostDir(&tr, hostDir, -1);
+  if (tr.count > fs->sb.inodeCount - fs->sb.usedInodes)
+    fail(11, "Not enough free inodes for the tree");
+
+  int32_t top = goToDirWithoutCheck(fs, path);
+  if (top == -1) {
+    fsmkdir(fs, path);
+    top = goToDir(fs, path);
+  }
+  Inode in;
+  readInode(fs, top, &in);
+  if (in.type != 'd')
+    fail(33, "%s is not a directory", path);
+  RunWriter run;
+  memset(&run, 0, sizeof(run));
+  run.buffer = allocBlocks(fs, copyChunkBlocks(fs));
+  if (run.buffer == NULL)
+    failErrno(23, "Error allocating memory for copying the tree");
+  holdMemory(&run.buffer);
+  //the objects whose creation and whose data the syncs so far committed, an error undoes only the
+  //changes after the last sync. The threads have to be stopped before an error leaves this function
+  uint32_t created = 0;
+  uint32_t written = 0;
+  ErrorBoundary boundary;
+  boundary.heldMark = heldCount;
+  boundary.outer = currentBoundary;
+  boundary.code = 0;
+  if (setjmp(boundary.jump) == 0) {
+    currentBoundary = &boundary;
+    uint64_t blocks = 0;
+    //a big tree doesn't fit in one transaction, so it is committed between the objects when the journal
+    //fills, each transaction leaves the image with whole objects
+    for (uint32_t i = 0; i < tr.count; i++) {
+      if (journalFilling(fs)) {
+        syncFS(fs);
+        created = i;
+      }
+      createImported(fs, &tr, &tr.entries[i], top);
+      if (tr.entries[i].size > inlineDataSize)
+        blocks += blocksForSize(fs, tr.entries[i].size);
+    }
+    if (blocks > (uint32_t)(fs->sb.dataBlocks - fs->sb.usedDataBlocks))
+      fail(17, "The tree is too big for the free datablocks");
+    for (uint32_t i = 0; i < tr.count && !tr.compress && !dedupEnabled(fs); i++) {
+      if (journalFilling(fs)) {
+        syncFS(fs);
+        created = tr.count;
+      }
+      if (isSmallFile(&tr.entries[i]))
+        allocateImported(fs, &tr.entries[i]);
+    }
+    startTransferPool(&tr, importWorker);
+    for (; tr.done < tr.count; tr.done++) {
+      //the data in the run is written before the transaction which may have its checksums
+      if (journalFilling(fs)) {
+        flushRun(fs, &run);
+        syncFS(fs);
+        created = tr.count;
+        written = tr.done;
+      }
+      writeImported(fs, &tr, &run);
+    }
+    flushRun(fs, &run);
+  }
+  currentBoundary = boundary.outer;
+  if (tr.started > 0)
+    stopTransferPool(&tr);
+  if (boundary.code != 0) {
+    char message[errorMessageSize];
+    strcpy(message, lastError);
+    //the changes since the last sync are undone and the committed files whose data didn't reach
+    //the image are left empty
+    rollBack(fs);
+    beginChange(fs);
+    for (uint32_t i = written; i < created; i++) {
+      if (tr.entries[i].type == 'f') {
+        readInode(fs, tr.entries[i].inode, &in);
+        freeFileBlocks(fs, &in);
+        in.size = 0;
+        updateInode(fs, &in);
+      }
+    }
+    keepChanges(fs);
+    freeHeld(&run.buffer);
+    letGo(&tr);
+    freeTransfer(&tr);
+    fail(boundary.code, "%s", message);
+  }
+  freeHeld(&run.buffer);
+  letGo(&tr);
+  freeTransfer(&tr);
+}
+
+//adds the contents of the directory of the image to the plan of the export, in the order of the rows
+static void walkImageDir(FileSystem* fs, Transfer* tr, uint32_t dir, char hostDir[], int32_t parent) {
+  int count;
+  BdsmStat* rows = listDirInode(fs, dir, &count);
+  holdMemory(&rows);
+  for (int i = 0; i < count; i++) {
+    uint32_t index = addTransferEntry(tr, joinPath(hostDir, rows[i].name), parent, rows[i].type);
+    TransferEntry* entry = &tr->entries[index];
+    entry->size = rows[i].size;
+    entry->permissions = rows[i].permissions;
+    entry->uid = rows[i].uid;
+    entry->gid = rows[i].gid;
+    entry->inode = rows[i].inode;
+    if (rows[i].type == 'd')
+      walkImageDir(fs, tr, rows[i].inode, entry->hostPath, index);
+  }
+  freeHeld(&rows);
+}
+
+//the mode is set after the file is written, so that read-only files can be written too,
+//the owner only if the process may change it
+static int setHostOwner(int fd, TransferEntry* entry) {
+  if (fchmod(fd, modeFromPermissions(entry->permissions)) != 0)
+    return -1;
+  if (geteuid() == 0 && fchown(fd, entry->uid, entry->gid) != 0)
+    return -1;
+  return 0;
+}
+
+//writes the small file and frees its data, runs in the pool
+static void writeHostFile(TransferEntry* entry) {
+  int fd = open(entry->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    entry->error = errno;
+    return;
+  }
+  for (uint32_t done = 0; done < entry->size; ) {
+    ssize_t count = write(fd, entry->data + done, entry->size - done);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0) {
+      entry->error = errno;
+      break;
+    }
+    done += count;
+  }
+  if (entry->error == 0 && setHostOwner(fd, entry) != 0)
+    entry->error = errno;
+  if (close(fd) != 0 && entry->error == 0)
+    entry->error = errno;
+  free(entry->data);
+  entry->data = NULL;
+}
+
+static void* exportWorker(void* arg) {
+  Transfer* tr = arg;
+  pthread_mutex_lock(&tr->lock);
+  for (;;) {
+    while (tr->next < tr->count && !isSmallFile(&tr->entries[tr->next]))
+      tr->next++;
+    if (tr->next == tr->count)
+      break;
+    TransferEntry* entry = &tr->entries[tr->next];
+    //after an error in the calling thread the files which are not read yet never will be
+    if (!entry->ready) {
+      if (tr->stop)
+        break;
+      pthread_cond_wait(&tr->changed, &tr->lock);
+      continue;
+    }
+    tr->next++;
+    pthread_mutex_unlock(&tr->lock);
+    writeHostFile(entry);
+    pthread_mutex_lock(&tr->lock);
+    tr->inFlight -= entry->size;
+    pthread_cond_broadcast(&tr->changed);
+  }
+  pthread_mutex_unlock(&tr->lock);
+  return NULL;
+}
+
+static void readExported(FileSystem* fs, Transfer* tr) {
+  TransferEntry* entry = &tr->entries[tr->done];
+  if (entry->type != 'f')
+    return;
+  Inode in;
+  readInode(fs, entry->inode, &in);
+  if (!isSmallFile(entry)) {
+    int fd = open(entry->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+      failErrno(16, "Error opening %s for writing", entry->hostPath);
+    holdFd(&fd);
+    copyImageData(fs, &in, fd);
+    if (setHostOwner(fd, entry) != 0)
+      failErrno(19, "Error writing to %s", entry->hostPath);
+    letGo(&fd);
+    if (close(fd) != 0)
+      failErrno(19, "Error writing to %s", entry->hostPath);
+    return;
+  }
+
+  pthread_mutex_lock(&tr->lock);
+  while (tr->inFlight > 0 && tr->inFlight + entry->size > transferWindowBytes)
+    pthread_cond_wait(&tr->changed, &tr->lock);
+  tr->inFlight += entry->size;
+  pthread_mutex_unlock(&tr->lock);
+  if (entry->size > 0) {
+    entry->data = malloc(entry->size);
+    if (entry->data == NULL)
+      failErrno(23, "Error allocating memory for copying the tree");
+    readFileRange(fs, &in, 0, entry->data, entry->size);
+  }
+  pthread_mutex_lock(&tr->lock);
+  entry->ready = true;
+  pthread_cond_broadcast(&tr->changed);
+  pthread_mutex_unlock(&tr->lock);
+}
+
+//copies the directory path of the image into the host directory, which is created if needed
+static void exportTree(FileSystem* fs, char path[], char hostDir[]) {
+  if (strcmp(path, "+/") != 0 && !validatePath(path))
+    fail(12, "Invalid path");
+  uint32_t top = goToDir(fs, path);
+  Inode in;
+  readInode(fs, top, &in);
+  if (in.type != 'd')
+    fail(33, "%s is not a directory", path);
+  if (mkdir(hostDir, 0755) != 0 && errno != EEXIST)
+    failErrno(16, "Error creating %s", hostDir);
+  Transfer tr;
+  memset(&tr, 0, sizeof(tr));
+  hold(&tr, releaseTransfer);
+  walkImageDir(fs, &tr, top, hostDir, -1);
+  //the directories get their modes at the end, until then their owner can write in them
+  for (uint32_t i = 0; i < tr.count; i++) {
+    if (tr.entries[i].type == 'd' && mkdir(tr.entries[i].hostPath, 0700) != 0 && errno != EEXIST)
+      failErrno(16, "Error creating %s", tr.entries[i].hostPath);
+  }
+
+  startTransferPool(&tr, exportWorker);
+  ErrorBoundary boundary;
+  boundary.heldMark = heldCount;
+  boundary.outer = currentBoundary;
+  boundary.code = 0;
+  if (setjmp(boundary.jump) == 0) {
+    currentBoundary = &boundary;
+    for (; tr.done < tr.count; tr.done++) {
+      readExported(fs, &tr);
+    }
+  }
+  currentBoundary = boundary.outer;
+  //the threads write the files which are read already before they stop
+  stopTransferPool(&tr);
+  char message[errorMessageSize];
+  strcpy(message, lastError);
+  for (uint32_t i = 0; boundary.code == 0 && i < tr.count; i++) {
+    if (tr.entries[i].error != 0) {
+      boundary.code = 19;
+      snprintf(message, sizeof(message), "Error writing to %s: %s", tr.entries[i].hostPath, strerror(tr.entries[i].error));
+    }
+  }
+  //from the deepest directory up, so that read-only directories don't stop the ones in them
+  for (uint32_t i = tr.count; boundary.code == 0 && i > 0; i--) {
+    TransferEntry* entry = &tr.entries[i - 1];
+    if (entry->type != 'd')
+      continue;
+    if (chmod(entry->hostPath, modeFromPermissions(entry->permissions)) != 0 ||
+        (geteuid() == 0 && chown(entry->hostPath, entry->uid, entry->gid) != 0)) {
+      boundary.code = 19;
+      snprintf(message, sizeof(message), "Error writing to %s: %s", entry->hostPath, strerror(errno));
+    }
+  }
+  letGo(&tr);
+  freeTransfer(&tr);
+  if (boundary.code != 0)
+    fail(boundary.code, "%s", message);
+}
+
+//once again had to choose a different name
+static void fsrmdir(FileSystem* fs, char path[]) {
+  if (strcmp(path, "+/") != 0 && !validatePath(path)) 
+    fail(12, "Invalid path");
+  uint32_t inode = goToDir(fs, path);
+  Inode inC;
+  readInode(fs, inode, &inC);
+  if (inC.id == 0 || inC.size != 0 || inC.type != 'd')
+    fail(21, "Trying to delete either a non-empty dir on something which is not a directory");
+  int nameSize = 32;
+  char* name = malloc(nameSize);
+  if (name == NULL)
+    failErrno(23, "Error allocating memory for the name");
+  holdMemory(&name);
+  int position = 0;
+
+  //<= because we want to access the '\0' too
+  for (size_t i = 2; i <= strlen(path); i++) {
+    while (path[i] != '/' && path[i] != '\0') {
+      if (position < nameSize - 1) {
+        name[position++] = path[i++];
+      } else {
+        nameSize *= 2;
+        char* newName = malloc(nameSize);
+        if (newName == NULL)
+          failErrno(23, "Error allocating memory for the name");
+        strncpy(newName, name, nameSize/2);
+        char* toDelete = name;
+        name = newName;
+        free(toDelete);
+        name[position++] = path[i++];
+      }
+    }
+    name[position] = '\0';
+    position = 0;
+  }
+  int size = strlen(path) - strlen(name) + 1;
+  char* goTo = malloc(size);
+  if (goTo == NULL)
+    failErrno(23, "Error allocating memory for the path");
+  holdMemory(&goTo);
+  strncpy(goTo, path, size - 1);
+  goTo[size - 1] = '\0';
+  uint32_t parentDir = goToDir(fs, goTo);
+  Inode in;
+  readInode(fs, parentDir, &in);
+  removeFromDir(fs, &in, name);
+  updateInode(fs, &in);
+  setDentry(fs, in.id, name, -1);
+  //an empty hashed directory still has its buckets
+  freeFileBlocks(fs, &inC);
+  deleteInode(fs, inC.id);
+  freeHeld(&name);
+  freeHeld(&goTo);
+}
+
+//the state shared by the threads of the full fsck. The threads read the image only with
+//readBlockRun, which doesn't change the cache, and the inodes from the table loaded in memory
+struct FsckState {
+  FileSystem* fs;
+  char* inodeTable;
+  //one bit for each inode which a directory row points to and one for each datablock used by an inode
+  uint64_t* reachable;
+  uint64_t* owned;
+  //with dedup - the reference count of every datablock and how many times the inodes use it
+  uint32_t* references;
+  uint32_t* claims;
+  //the directories which are still not read
+  uint32_t* stack;
+  uint32_t stackSize;
+  uint32_t stackCapacity;
+  //the directories in the stack or being read at the moment, the threads stop when it gets to 0
+  uint32_t pending;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  //the problems found, updated atomically by the threads
+  uint64_t badInodes;
+  uint64_t danglingRows;
+  uint64_t doubleLinks;
+  uint64_t doubleOwned;
+  uint64_t badExtents;
+  uint64_t badSizes;
+  //the first error in one of the threads, they can't jump to the boundary of the caller
+  int errorCode;
+  char errorMessage[errorMessageSize];
+};
+
+typedef struct FsckState FsckState;
+
+//sets the bit and returns whether it was already set
+static bool testAndSetBit(uint64_t* words, uint32_t bit) {
+  uint64_t mask = 1ULL << (bit % 64);
+  return (__atomic_fetch_or(&words[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static bool bitIsSet(uint64_t* words, uint32_t bit) {
+  return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void countProblem(uint64_t* counter) {
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static Inode* fsckInode(FsckState* st, uint32_t id) {
+  uint32_t perBlock = st->fs->sb.inodesPerDatablock;
+  return (Inode*)(st->inodeTable + (size_t)(id / perBlock) * st->fs->blockSize + (id % perBlock) * sizeof(Inode));
+}
+
+//marks the datablocks of the run as used by an inode, false if the run is outside of the datablocks
+static bool claimRun(FsckState* st, int32_t start, uint32_t length) {
+  if (start < 0 || (int64_t)start + length > st->fs->sb.dataBlocks) {
+    countProblem(&st->badExtents);
+    return false;
+  }
+  for (uint32_t i = 0; i < length; i++) {
+    //a tracked datablock may be used as many times as its reference count, which is checked at the end
+    bool tracked = st->references != NULL && st->references[start + i] > 0;
+    if (tracked)
+      __atomic_add_fetch(&st->claims[start + i], 1, __ATOMIC_RELAXED);
+    if (testAndSetBit(st->owned, start + i) && !tracked)
+      countProblem(&st->doubleOwned);
+  }
+  return true;
+}
+
+//as loadExtents, but without the cache. The datablocks of the inode and its extent blocks are
+//claimed and the extents outside of the datablocks are left out
+static Extent* claimExtents(FsckState* st, Inode* in, int* count) {
+  int perBlock = extentsPerBlock(st->fs);
+  Extent* extents = malloc(inodeExtents * sizeof(Extent));
+  if (extents == NULL)
+    failErrno(29, "Error allocating memory for the extents of fsck");
+  holdMemory(&extents);
+  *count = 0;
+  for (int i = 0; i < inodeExtents && in->extents[i].length != 0; i++) {
+    if (claimRun(st, in->extents[i].start, in->extents[i].length))
+      extents[(*count)++] = in->extents[i];
+  }
+  char buffer[st->fs->blockSize];
+  ExtentBlock* block = (ExtentBlock*)buffer;
+  int32_t current = in->indirect;
+  //a chain which goes back to an already claimed block is either shared or a loop, so it is not followed
+  while (current != -1) {
+    if (current < 0 || (uint32_t)current >= st->fs->sb.dataBlocks) {
+      countProblem(&st->badExtents);
+      break;
+    }
+    if (testAndSetBit(st->owned, current)) {
+      countProblem(&st->doubleOwned);
+      break;
+    }
+    readBlockRun(st->fs, datablockPosition(st->fs, current), 1, buffer);
+    if (block->count > (uint32_t)perBlock) {
+      countProblem(&st->badExtents);
+      break;
+    }
+    Extent* grown = realloc(extents, (*count + block->count > 0 ? *count + block->count : 1) * sizeof(Extent));
+    if (grown == NULL)
+      failErrno(29, "Error allocating memory for the extents of fsck");
+    extents = grown;
+    for (uint32_t i = 0; i < block->count; i++) {
+      if (claimRun(st, block->extents[i].start, block->extents[i].length))
+        extents[(*count)++] = block->extents[i];
+    }
+    current = block->next;
+  }
+
+  uint32_t blocks = extentsLength(extents, *count);
+  if (in->type == 'd' && (in->reserved & inodeFlagHashed)) {
+    if (blocks == 0 || blocks > maxDirBuckets)
+      countProblem(&st->badSizes);
+  } else if (in->reserved & inodeFlagInline) {
+    if (blocks != 0 || in->size > inlineDataSize)
+      countProblem(&st->badSizes);
+  } else if (in->reserved & inodeFlagCompressed) {
+    //the lengths of the chunks are not read, a chunk takes from one block to all of its blocks
+    uint32_t tableBlocks = chunkTableBlocks(st->fs, in->size);
+    if (blocks < tableBlocks + chunksForSize(in->size) || blocks > blocksForSize(st->fs, in->size) + tableBlocks)
+      countProblem(&st->badSizes);
+  } else if (blocks != in->size / st->fs->blockSize + (in->size % st->fs->blockSize == 0 ? 0 : 1)) {
+    countProblem(&st->badSizes);
+  }
+  letGo(&extents);
+  return extents;
+}
+
+static void pushDir(FsckState* st, uint32_t dir) {
+  pthread_mutex_lock(&st->lock);
+  if (st->stackSize == st->stackCapacity) {
+    uint32_t* stack = realloc(st->stack, (st->stackCapacity * 2 + 16) * sizeof(uint32_t));
+    if (stack == NULL) {
+      pthread_mutex_unlock(&st->lock);
+      failErrno(29, "Error allocating memory for the directories of fsck");
+    }
+    st->stack = stack;
+    st->stackCapacity = st->stackCapacity * 2 + 16;
+  }
+  st->stack[st->stackSize++] = dir;
+  st->pending++;
+  pthread_cond_signal(&st->changed);
+  pthread_mutex_unlock(&st->lock);
+}
+
+//the next directory to read, -1 when all directories are read
+static int64_t popDir(FsckState* st) {
+  pthread_mutex_lock(&st->lock);
+  while (st->stackSize == 0 && st->pending > 0) {
+    pthread_cond_wait(&st->changed, &st->lock);
+  }
+  int64_t dir = st->stackSize == 0 ? -1 : (int64_t)st->stack[--st->stackSize];
+  pthread_mutex_unlock(&st->lock);
+  return dir;
+}
+
+static void finishDir(FsckState* st) {
+  pthread_mutex_lock(&st->lock);
+  if (--st->pending == 0)
+    pthread_cond_broadcast(&st->changed);
+  pthread_mutex_unlock(&st->lock);
+}
+
+//checks one row of a directory - the inode must be allocated and written and no other row may point to it
+static void checkRow(FsckState* st, DirectoryRow* row) {
+  Superblock* sb = &st->fs->sb;
+  uint32_t child = row->inodeNum;
+  if (child >= sb->inodesHighWater || !bitIsSet(st->fs->inodeBitmap.words, child)) {
+    countProblem(&st->danglingRows);
+    return;
+  }
+  Inode* in = fsckInode(st, child);
+  if (in->id != child || (in->type != 'd' && in->type != 'f')) {
+    countProblem(&st->badInodes);
+    return;
+  }
+  if (testAndSetBit(st->reachable, child)) {
+    countProblem(&st->doubleLinks);
+    return;
+  }
+  if (in->type == 'd') {
+    pushDir(st, child);
+  } else {
+    int count;
+    free(claimExtents(st, in, &count));
+  }
+}
+
+//the blocks of the directory are read in batches with the queue of the thread, the runs of several
+//extents together
+static void readFsckDir(FsckState* st, uint32_t dir, char* buffer, IoQueue* q) {
+  int rowsPerDb = st->fs->blockSize / sizeof(DirectoryRow);
+  Inode in = *fsckInode(st, dir);
+  bool hashed = in.reserved & inodeFlagHashed;
+  uint32_t rowsCount = in.size / sizeof(DirectoryRow);
+  uint32_t rowsSeen = 0;
+  int extentCount;
+  Extent* extents = claimExtents(st, &in, &extentCount);
+  holdMemory(&extents);
+  BlockRun* runs = malloc((extentCount > 0 ? extentCount : 1) * sizeof(BlockRun));
+  if (runs == NULL)
+    failErrno(23, "Error allocating memory for checking the directories");
+  holdMemory(&runs);
+  int index = 0;
+  uint32_t done = 0;
+  while (index < extentCount) {
+    uint32_t batched;
+    int runCount = nextRuns(st->fs, extents, extentCount, &index, &done, batchBlocks(st->fs), runs, &batched);
+    readBlockRuns(st->fs, q, runs, runCount, buffer);
+    for (uint32_t j = 0; j < batched * rowsPerDb; j++) {
+      DirectoryRow* row = (DirectoryRow*)(buffer + (size_t)(j / rowsPerDb) * st->fs->blockSize) + j % rowsPerDb;
+      if (hashed ? row->name[0] == '\0' : rowsSeen >= rowsCount)
+        continue;
+      rowsSeen++;
+      checkRow(st, row);
+    }
+  }
+  freeHeld(&runs);
+  for (uint32_t i = 0; (in.reserved & inodeFlagInline) && i < inlineDataSize / sizeof(DirectoryRow) && rowsSeen < rowsCount; i++) {
+    rowsSeen++;
+    checkRow(st, (DirectoryRow*)in.inlineData + i);
+  }
+  if (rowsSeen != rowsCount)
+    countProblem(&st->badSizes);
+  freeHeld(&extents);
+}
+
+static void* fsckWorker(void* arg) {
+  FsckState* st = arg;
+  char* buffer = allocBlocks(st->fs, batchBlocks(st->fs));
+  IoQueue queue;
+  memset(&queue, 0, sizeof(queue));
+  ErrorBoundary boundary;
+  boundary.heldMark = heldCount;
+  boundary.outer = NULL;
+  for (int64_t dir = popDir(st); dir != -1; dir = popDir(st)) {
+    //after an error the directory counts as read, so that the other threads don't wait for it
+    if (setjmp(boundary.jump) == 0) {
+      currentBoundary = &boundary;
+      //without the buffer every directory fails, so the others are still not waited for
+      if (buffer == NULL)
+        failErrno(29, "Error allocating memory for the directories of fsck");
+      readFsckDir(st, dir, buffer, &queue);
+    } else {
+      pthread_mutex_lock(&st->lock);
+      if (st->errorCode == 0) {
+        st->errorCode = boundary.code;
+        strcpy(st->errorMessage, lastError);
+      }
+      pthread_mutex_unlock(&st->lock);
+    }
+    currentBoundary = NULL;
+    finishDir(st);
+  }
+  stopIoQueue(&queue);
+  free(buffer);
+  return NULL;
+}
+
+//the set bits of a which are not set in b
+static uint64_t countDifference(uint64_t* a, uint64_t* b, uint32_t bits) {
+  uint64_t count = 0;
+  for (uint32_t i = 0; i < bits / 64; i++) {
+    count += __builtin_popcountll(a[i] & ~b[i]);
+  }
+  if (bits % 64 != 0)
+    count += __builtin_popcountll(a[bits / 64] & ~b[bits / 64] & ((1ULL << (bits % 64)) - 1));
+  return count;
+}
+
+//reads the written part of the inode table and the used part of the datablocks and returns
+//how many of the blocks don't match their checksums
+static uint64_t scrubChecksums(FileSystem* fs) {
+  Superblock* sb = &fs->sb;
+  int64_t ranges[2][2] = {
+    {sb->inodeTableStart, sb->inodeTableStart + sb->inodesHighWater / sb->inodesPerDatablock + (sb->inodesHighWater % sb->inodesPerDatablock == 0 ? 0 : 1)},
+    {sb->firstDatablock, sb->firstDatablock + (int64_t)sb->datablocksHighWater}
+  };
+  uint64_t mismatches = 0;
+  uint32_t bufferBlocks = batchBlocks(fs);
+  char* buffer = allocBlocks(fs, bufferBlocks);
+  if (buffer == NULL)
+    failErrno(29, "Error allocating memory for checking the checksums");
+  holdMemory(&buffer);
+  for (int r = 0; r < 2; r++) {
+    for (int64_t first = ranges[r][0]; first < ranges[r][1]; first += bufferBlocks) {
+      int count = ranges[r][1] - first < bufferBlocks ? ranges[r][1] - first : bufferBlocks;
+      readBlockRun(fs, first, count, buffer);
+      for (int i = 0; i < count; i++) {
+        if (!checksumMatches(fs, first + i, buffer + (size_t)i * fs->blockSize))
+          mismatches++;
+      }
+    }
+  }
+  freeHeld(&buffer);
+  return mismatches;
+}
+
+//reads count words of the dedup area from the first one, which starts a block, without the cache
+static uint32_t* readDedupWords(FileSystem* fs, uint64_t first, uint32_t count) {
+  uint32_t blocks = referenceBlocks(fs, count);
+  uint32_t* words = allocBlocks(fs, blocks);
+  holdMemory(&words);
+  if (words == NULL)
+    failErrno(23, "Error allocating memory for the dedup area");
+  readBlockRun(fs, fs->sb.dedupStart + first / dedupWordsPerBlock(fs), blocks, (char*)words);
+  letGo(&words);
+  return words;
+}
+
+//the reference counts must match how many times the inodes use the datablocks and the counters in
+//the superblock, and the index must hold exactly the tracked datablocks
+static uint64_t checkReferences(FileSystem* fs, FsckState* st) {
+  Superblock* sb = &fs->sb;
+  uint64_t wrong = 0;
+  uint64_t tracked = 0;
+  uint64_t saved = 0;
+  for (uint32_t db = 0; db < sb->dataBlocks; db++) {
+    if (st->references[db] == 0)
+      continue;
+    if (st->claims[db] != st->references[db])
+      wrong++;
+    tracked++;
+    saved += st->references[db] - 1;
+  }
+  uint32_t* index = readDedupWords(fs, (uint64_t)referenceBlocks(fs, sb->dataBlocks) * dedupWordsPerBlock(fs), sb->dedupSlots);
+  uint64_t entries = 0;
+  for (uint32_t slot = 0; slot < sb->dedupSlots; slot++) {
+    if (index[slot] == 0)
+      continue;
+    entries++;
+    if (index[slot] > sb->dataBlocks || st->references[index[slot] - 1] == 0)
+      wrong++;
+  }
+  free(index);
+  if (entries != tracked || tracked != sb->dedupBlocks || saved != sb->dedupSaved)
+    wrong++;
+  return wrong;
+}
+
+//walks the whole tree from the root with several threads and compares the inodes and datablocks
+//which are really used with the bitmaps and the counters in the superblock
+static void fsckFull(FileSystem* fs, BdsmFsckReport* report) {
+  Superblock* sb = &fs->sb;
+  FsckState st;
+  memset(&st, 0, sizeof(st));
+  st.fs = fs;
+  uint64_t checksumErrors = scrubChecksums(fs);
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.changed, NULL);
+
+  //the inode table is read up to the high water mark with as few reads as possible
+  uint32_t tableBlocks = sb->inodesHighWater / sb->inodesPerDatablock + (sb->inodesHighWater % sb->inodesPerDatablock == 0 ? 0 : 1);
+  holdMemory(&st.stack);
+  st.inodeTable = allocBlocks(fs, tableBlocks > 0 ? tableBlocks : 1);
+  holdMemory(&st.inodeTable);
+  st.reachable = calloc(sb->inodeCount / 64 + 1, sizeof(uint64_t));
+  holdMemory(&st.reachable);
+  st.owned = calloc(sb->dataBlocks / 64 + 1, sizeof(uint64_t));
+  holdMemory(&st.owned);
+  if (st.inodeTable == NULL || st.reachable == NULL || st.owned == NULL)
+    failErrno(29, "Error allocating memory for fsck");
+  readBlockRun(fs, sb->inodeTableStart, tableBlocks, st.inodeTable);
+  if (dedupEnabled(fs)) {
+    st.references = readDedupWords(fs, 0, sb->dataBlocks);
+    holdMemory(&st.references);
+    st.claims = calloc(sb->dataBlocks, sizeof(uint32_t));
+    holdMemory(&st.claims);
+    if (st.claims == NULL)
+      failErrno(29, "Error allocating memory for fsck");
+  }
+
+  //the allocated inodes after the high water mark were never written
+  for (uint32_t i = sb->inodesHighWater; i < sb->inodeCount; i++) {
+    if (bitIsSet(fs->inodeBitmap.words, i))
+      st.badInodes++;
+  }
+
+  if (sb->inodesHighWater == 0 || !bitIsSet(fs->inodeBitmap.words, 0) || fsckInode(&st, 0)->type != 'd') {
+    st.badInodes++;
+  } else {
+    testAndSetBit(st.reachable, 0);
+    pushDir(&st, 0);
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount < 1)
+      threadCount = 1;
+    if (threadCount > maxFsckThreads)
+      threadCount = maxFsckThreads;
+    pthread_t threads[maxFsckThreads];
+    //the threads use st, so the ones which started are waited for even if the rest can't start
+    long started = 0;
+    while (started < threadCount && pthread_create(&threads[started], NULL, fsckWorker, &st) == 0) {
+      started++;
+    }
+    for (long i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    if (started == 0)
+      fail(30, "Error starting the fsck threads");
+  }
+
+  uint64_t leakedInodes = countDifference(fs->inodeBitmap.words, st.reachable, sb->inodeCount);
+  uint64_t leakedBlocks = countDifference(fs->blockBitmap.words, st.owned, sb->dataBlocks);
+  uint64_t freeButUsed = countDifference(st.owned, fs->blockBitmap.words, sb->dataBlocks);
+  uint64_t wrongReferences = st.references != NULL && st.errorCode == 0 ? checkReferences(fs, &st) : 0;
+  freeHeld(&st.references);
+  freeHeld(&st.claims);
+  freeHeld(&st.inodeTable);
+  freeHeld(&st.reachable);
+  freeHeld(&st.owned);
+  freeHeld(&st.stack);
+  pthread_mutex_destroy(&st.lock);
+  pthread_cond_destroy(&st.changed);
+  if (st.errorCode != 0)
+    fail(st.errorCode, "%s", st.errorMessage);
+
+  report->checked = true;
+  report->badInodes = st.badInodes;
+  report->danglingRows = st.danglingRows;
+  report->doubleLinks = st.doubleLinks;
+  report->unreachableInodes = leakedInodes;
+  report->badExtents = st.badExtents;
+  report->wrongSizes = st.badSizes;
+  report->sharedDatablocks = st.doubleOwned;
+  report->leakedDatablocks = leakedBlocks;
+  report->usedFreeDatablocks = freeButUsed;
+  report->checksumErrors = checksumErrors;
+  report->wrongReferences = wrongReferences;
+  if (st.badInodes + st.danglingRows + st.doubleLinks + leakedInodes + st.badExtents + st.badSizes +
+      st.doubleOwned + leakedBlocks + freeButUsed + checksumErrors + wrongReferences != 0)
+    fail(10, "The file system is corrupted");
+}
+
+//the number of used inodes or datablocks according to the bitmap
+static uint32_t usedBits(Bitmap* bm) {
+  uint64_t used = 0;
+  for (uint32_t i = 0; i < bm->blocks * (bm->blockSize / sizeof(uint64_t)); i++) {
+    used += __builtin_popcountll(bm->words[i]);
+  }
+  //the padding after the last bit is always set
+  return used - ((uint64_t)bm->blocks * bm->blockSize * 8 - bm->bits);
+}
+
+static void fsck(FileSystem* fs, bool full, BdsmFsckReport* report) {
+  //in batch mode the superblock in memory may be newer than the one in the image
+  syncFS(fs);
+  Superblock sb = fs->sb;
+  //printSuperblock(&sb);
+  int sbCheckSum = sb.checkSum;
+  sb.checkSum = 0;
+  int calculatedCheckSum = Fletcher16((uint8_t*)&sb, sizeof(sb));
+  sb.checkSum = sbCheckSum;
+
+  if (calculatedCheckSum != sb.checkSum) {
+    fail(10, "The file system is corrupted");
+  }
+
+  //printf("%d\n", sb.checkSum);
+
+  loadBitmaps(fs);
+  if (usedBits(&fs->inodeBitmap) != sb.usedInodes)
+    fail(10, "The file system is corrupted");
+  
+  if (usedBits(&fs->blockBitmap) != sb.usedDataBlocks)
+    fail(10, "The file system is corrupted");
+
+  if (full)
+    fsckFull(fs, report);
+}
+
+
+//the part of bdsmOpen and bdsmMkfs which can fail, after a failure the caller frees fs
+static int startFS(FileSystem* fs, char image[], int flag, bool format) {
+  enterLibrary();
+  openFS(fs, image, flag, format);
+  if (format) {
+    mkfs(fs);
+  } else {
+    checkVersion(fs);
+    initJournal(fs);
+    initChecksums(fs);
+  }
+  leaveLibrary(0);
+}
+
+int bdsmOpen(char image[], int flag, Bdsm** result) {
+  FileSystem* fs = calloc(1, sizeof(FileSystem));
+  if (fs == NULL) {
+    snprintf(lastError, sizeof(lastError), "Error allocating memory for the file system");
+    return -23;
+  }
+  int code = startFS(fs, image, flag, false);
+  if (code != 0) {
+    releaseFS(fs);
+    free(fs);
+    return code;
+  }
+  *result = fs;
+  return 0;
+}
+
+int bdsmMkfs(char image[]) {
+  FileSystem* fs = calloc(1, sizeof(FileSystem));
+  if (fs == NULL) {
+    snprintf(lastError, sizeof(lastError), "Error allocating memory for the file system");
+    return -23;
+  }
+  int code = startFS(fs, image, O_RDWR, true);
+  if (code != 0) {
+    releaseFS(fs);
+    free(fs);
+    return code;
+  }
+  return bdsmClose(fs);
+}
+
+int bdsmSync(Bdsm* fs) {
+  enterLibrary();
+  syncFS(fs);
+  leaveLibrary(0);
+}
+
+int bdsmClose(Bdsm* fs) {
+  int code = bdsmSync(fs);
+  releaseFS(fs);
+  free(fs);
+  return code;
+}
+
+int bdsmInfo(Bdsm* fs, BdsmInfo* info) {
+  memset(info, 0, sizeof(*info));
+  info->fsSize = fs->sb.fsSize;
+  info->fsType = fs->sb.fsType;
+  info->inodeCount = fs->sb.inodeCount;
+  info->inodeSize = sizeof(Inode);
+  info->usedInodes = fs->sb.usedInodes;
+  info->dataBlocks = fs->sb.dataBlocks;
+  info->blockSize = fs->blockSize;
+  info->usedDataBlocks = fs->sb.usedDataBlocks;
+  info->inodesHighWater = fs->sb.inodesHighWater;
+  info->datablocksHighWater = fs->sb.datablocksHighWater;
+  info->journalBlocks = fs->sb.journalBlocks;
+  info->journalSequence = fs->journal.sequence;
+  info->dentryHits = fs->dentryHits;
+  info->dentryMisses = fs->dentryMisses;
+  info->replayedBlocks = fs->replayedBlocks;
+  info->dedup = dedupEnabled(fs);
+  info->dedupBlocks = fs->sb.dedupBlocks;
+  info->dedupSaved = fs->sb.dedupSaved;
+  info->dedupHits = fs->dedupHits;
+  info->dedupMisses = fs->dedupMisses;
+  return 0;
+}
+
+int bdsmFsck(Bdsm* fs, bool full, BdsmFsckReport* report) {
+  memset(report, 0, sizeof(*report));
+  enterLibrary();
+  fsck(fs, full, report);
+  leaveLibrary(0);
+}
+
+int bdsmMkdir(Bdsm* fs, char path[]) {
+  enterChange(fs);
+  fsmkdir(fs, path);
+  leaveChange(fs, 0);
+}
+
+int bdsmRmdir(Bdsm* fs, char path[]) {
+  enterChange(fs);
+  fsrmdir(fs, path);
+  leaveChange(fs, 0);
+}
+
+int bdsmStat(Bdsm* fs, char path[], BdsmStat* st) {
+  enterLibrary();
+  statObject(fs, path, st);
+  leaveLibrary(0);
+}
+
+int bdsmReadDir(Bdsm* fs, char path[], BdsmStat** entries, int* count) {
+  enterLibrary();
+  *entries = listDir(fs, path, count);
+  leaveLibrary(0);
+}
+
+int bdsmCopyIn(Bdsm* fs, char from[], char to[]) {
+  enterChange(fs);
+  copyToFS(fs, from, to);
+  leaveChange(fs, 0);
+}
+
+int bdsmCopyOut(Bdsm* fs, char from[], char to[]) {
+  enterLibrary();
+  copyFromFS(fs, from, to);
+  leaveLibrary(0);
+}
+
+int bdsmOpenFile(Bdsm* fs, char path[], bool create, BdsmFile** file) {
+  //opening a file which is there changes nothing, so it works on an image opened only for reading
+  if (!create) {
+    enterLibrary();
+    *file = openFile(fs, path, false);
+    leaveLibrary(0);
+  }
+  enterChange(fs);
+  *file = openFile(fs, path, true);
+  leaveChange(fs, 0);
+}
+
+int64_t bdsmRead(BdsmFile* file, void* buffer, size_t size) {
+  enterLibrary();
+  Inode in;
+  readInode(file->fs, file->inode, &in);
+  uint32_t bytes = 0;
+  if (file->position < in.size) {
+    uint32_t left = in.size - file->position;
+    bytes = size < left ? size : left;
+  }
+  readFileRange(file->fs, &in, file->position, buffer, bytes);
+  file->position += bytes;
+  leaveLibrary(bytes);
+}
+
+//writing past the end fills the gap with zeroes first, as a write after lseek does
+int64_t bdsmWrite(BdsmFile* file, void* buffer, size_t size) {
+  enterChange(file->fs);
+  if (size > UINT32_MAX || file->position + (int64_t)size > UINT32_MAX)
+    fail(17, "The file would be too big");
+  Inode in;
+  readInode(file->fs, file->inode, &in);
+  if (file->position > in.size)
+    writeFileRange(file->fs, &in, in.size, NULL, file->position - in.size);
+  writeFileRange(file->fs, &in, file->position, buffer, size);
+  updateInode(file->fs, &in);
+  file->position += size;
+  leaveChange(file->fs, size);
+}
+
+int64_t bdsmSeek(BdsmFile* file, int64_t offset, int whence) {
+  enterLibrary();
+  int64_t base = 0;
+  if (whence == SEEK_CUR) {
+    base = file->position;
+  } else if (whence == SEEK_END) {
+    Inode in;
+    readInode(file->fs, file->inode, &in);
+    base = in.size;
+  } else if (whence != SEEK_SET) {
+    fail(34, "Invalid offset in the file");
+  }
+  if (base + offset < 0 || base + offset > UINT32_MAX)
+    fail(34, "Invalid offset in the file");
+  file->position = base + offset;
+  leaveLibrary(file->position);
+}
+
+int bdsmTruncate(BdsmFile* file, uint32_t size) {
+  enterChange(file->fs);
+  Inode in;
+  readInode(file->fs, file->inode, &in);
+  truncateFile(file->fs, &in, size);
+  updateInode(file->fs, &in);
+  leaveChange(file->fs, 0);
+}
+
+int bdsmCloseFile(BdsmFile* file) {
+  free(file);
+  return 0;
+}
+
+int bdsmImport(Bdsm* fs, char hostDir[], char path[]) {
+  enterChange(fs);
+  importTree(fs, hostDir, path);
+  leaveChange(fs, 0);
+}
+
+int bdsmExport(Bdsm* fs, char path[], char hostDir[]) {
+  enterLibrary();
+  exportTree(fs, path, hostDir);
+  leaveLibrary(0);
+}
@@ -0,0 +1,115 @@
+#ifndef LIBBDSM_H
+#define LIBBDSM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+//The storage manager as a library. Every function returns 0 (or a count of bytes) on success and
+//minus one of the error codes from documentation.txt on failure - nothing in the library calls exit.
+//bdsmError returns the message of the last failed call in the calling thread.
+//A handle can be used by one thread at a time, different handles can be used from different threads.
+//Paths inside the file system look like +/dir/file, the root is +/
+
+//an opened image, its contents are known only to the library
+typedef struct FileSystem Bdsm;
+
+//a file in the image opened for reading and writing at any offset
+typedef struct BdsmFile BdsmFile;
+
+//what bdsmStat and bdsmReadDir return for every object
+typedef struct {
+  char name[60];
+  uint32_t inode;
+  //'d' for directories and 'f' for regular files
+  char type;
+  uint16_t uid;
+  uint16_t gid;
+  //in base 10, e.g. 644
+  uint16_t permissions;
+  uint32_t size;
+  time_t mtime;
+} BdsmStat;
+
+//the layout of the image and the counters of the handle, as printed by debug
+typedef struct {
+  uint32_t fsSize;
+  uint16_t fsType;
+  uint32_t inodeCount;
+  uint32_t inodeSize;
+  uint32_t usedInodes;
+  uint32_t dataBlocks;
+  uint32_t blockSize;
+  uint32_t usedDataBlocks;
+  uint32_t inodesHighWater;
+  uint32_t datablocksHighWater;
+  uint32_t journalBlocks;
+  uint32_t journalSequence;
+  uint64_t dentryHits;
+  uint64_t dentryMisses;
+  //how many blocks were written from the journal when the image was opened
+  uint32_t replayedBlocks;
+  //set if the image was made with BDSM_DEDUP=on. The datablocks with a reference count, the blocks
+  //saved by sharing them and the blocks of the handle which were found in the image or not
+  bool dedup;
+  uint32_t dedupBlocks;
+  uint32_t dedupSaved;
+  uint64_t dedupHits;
+  uint64_t dedupMisses;
+} BdsmInfo;
+
+//the problems found by bdsmFsck with full set to true, filled even if the check fails
+typedef struct {
+  bool checked;
+  uint64_t badInodes;
+  uint64_t danglingRows;
+  uint64_t doubleLinks;
+  uint64_t unreachableInodes;
+  uint64_t badExtents;
+  uint64_t wrongSizes;
+  uint64_t sharedDatablocks;
+  uint64_t leakedDatablocks;
+  uint64_t usedFreeDatablocks;
+  uint64_t checksumErrors;
+  //datablocks whose reference count doesn't match their use and mistakes in the dedup index
+  uint64_t wrongReferences;
+} BdsmFsckReport;
+
+char* bdsmError(void);
+
+//creates a new file system in the image, which has to exist already with the wanted size
+int bdsmMkfs(char image[]);
+//flag is O_RDONLY or O_RDWR. The journal is replayed if the last command didn't finish
+int bdsmOpen(char image[], int flag, Bdsm** fs);
+//writes all changes as a single transaction of the journal
+int bdsmSync(Bdsm* fs);
+//syncs and frees the handle, which can't be used after that even if the sync fails
+int bdsmClose(Bdsm* fs);
+
+int bdsmInfo(Bdsm* fs, BdsmInfo* info);
+int bdsmFsck(Bdsm* fs, bool full, BdsmFsckReport* report);
+int bdsmMkdir(Bdsm* fs, char path[]);
+int bdsmRmdir(Bdsm* fs, char path[]);
+int bdsmStat(Bdsm* fs, char path[], BdsmStat* st);
+//entries gets a new array with the rows of the directory in their order, freed by the caller
+int bdsmReadDir(Bdsm* fs, char path[], BdsmStat** entries, int* count);
+//copy a whole file between the host and the image
+int bdsmCopyIn(Bdsm* fs, char from[], char to[]);
+int bdsmCopyOut(Bdsm* fs, char from[], char to[]);
+//copy a whole directory tree, directories and regular files only, with their owners and permissions
+int bdsmImport(Bdsm* fs, char hostDir[], char path[]);
+int bdsmExport(Bdsm* fs, char path[], char hostDir[]);
+
+//with create the file is made if it doesn't exist. The position starts at 0
+int bdsmOpenFile(Bdsm* fs, char path[], bool create, BdsmFile** file);
+//read and write from the position and move it, only the blocks in the range are touched
+int64_t bdsmRead(BdsmFile* file, void* buffer, size_t size);
+int64_t bdsmWrite(BdsmFile* file, void* buffer, size_t size);
+//whence is SEEK_SET, SEEK_CUR or SEEK_END, returns the new position
+int64_t bdsmSeek(BdsmFile* file, int64_t offset, int whence);
+//makes the file shorter or longer, the new part reads as zeroes
+int bdsmTruncate(BdsmFile* file, uint32_t size);
+int bdsmCloseFile(BdsmFile* file);
+
+#endif